@@ -0,0 +1,81 @@
+#ifndef MPMCQueue_H
+#define MPMCQueue_H
+
+#include <cstdint>
+#include <atomic>
+
+// Bounded ring of sequence-numbered cells (Vyukov). A cell's seq equals the
+// ticket of the producer allowed to fill it, and ticket + 1 once it is
+// readable; producers and consumers claim tickets with a CAS on their own
+// index and never touch each other's.
+template <typename T, int SIZE, int MASK = SIZE - 1>
+class alignas(128) MPMCQueue {
+public:
+    static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE");
+    MPMCQueue() {
+        for (uint64_t idx = 0; idx < SIZE; ++idx) {
+            buf[idx].seq.store(idx, std::memory_order_relaxed);
+        }
+    }
+
+    void put(const T *d) {
+        while (!try_put(d)) {}
+    }
+
+    void get(T *d) {
+        while (!try_get(d)) {}
+    }
+
+    bool try_put(const T *d) {
+        auto seq = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &cell = buf[seq & MASK];
+            auto cur = cell.seq.load(std::memory_order_acquire);
+            auto dif = (int64_t) (cur - seq);
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+                    cell.data = *d;
+                    cell.seq.store(seq + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                seq = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_get(T *d) {
+        auto seq = head.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &cell = buf[seq & MASK];
+            auto cur = cell.seq.load(std::memory_order_acquire);
+            auto dif = (int64_t) (cur - (seq + 1));
+            if (dif == 0) {
+                if (head.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+                    *d = cell.data;
+                    cell.seq.store(seq + SIZE, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                seq = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    // a cache line each, or neighbouring producers would share one.
+    struct alignas(64) cell_t {
+        std::atomic<uint64_t> seq;
+        T data;
+    };
+
+    alignas(128) std::atomic<uint64_t> head{0};
+    alignas(128) std::atomic<uint64_t> tail{0};
+    alignas(128) cell_t buf[SIZE];
+};
+
+#endif
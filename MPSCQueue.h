@@ -0,0 +1,69 @@
+#ifndef MPSCQueue_H
+#define MPSCQueue_H
+
+#include <cstdint>
+#include <atomic>
+
+// MPMCQueue with a single consumer: producers claim cells with a CAS on
+// tail, the consumer owns head outright and needs no atomic RMW.
+template <typename T, int SIZE, int MASK = SIZE - 1>
+class alignas(128) MPSCQueue {
+public:
+    static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE");
+    MPSCQueue() {
+        for (uint64_t idx = 0; idx < SIZE; ++idx) {
+            buf[idx].seq.store(idx, std::memory_order_relaxed);
+        }
+    }
+
+    void put(const T *d) {
+        while (!try_put(d)) {}
+    }
+
+    void get(T *d) {
+        while (!try_get(d)) {}
+    }
+
+    bool try_put(const T *d) {
+        auto seq = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &cell = buf[seq & MASK];
+            auto cur = cell.seq.load(std::memory_order_acquire);
+            auto dif = (int64_t) (cur - seq);
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+                    cell.data = *d;
+                    cell.seq.store(seq + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                seq = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer thread only.
+    bool try_get(T *d) {
+        auto &cell = buf[head & MASK];
+        if (cell.seq.load(std::memory_order_acquire) != head + 1) return false;
+        *d = cell.data;
+        cell.seq.store(head + SIZE, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+private:
+    // a cache line each, or neighbouring producers would share one.
+    struct alignas(64) cell_t {
+        std::atomic<uint64_t> seq;
+        T data;
+    };
+
+    alignas(128) uint64_t head = 0;
+    alignas(128) std::atomic<uint64_t> tail{0};
+    alignas(128) cell_t buf[SIZE];
+};
+
+#endif
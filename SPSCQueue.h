@@ -5,37 +5,112 @@
 #include <cstdint>
 #include <atomic>
 
-template <typename T, int SIZE, int MASK = SIZE - 1>
+#include "WaitStrategy.h"
+
+// Each side keeps a private copy of the other side's index and only reloads
+// the shared atomic when that copy says the queue is full (producer) or
+// empty (consumer). The _n variants move a batch with one release store.
+// WAIT decides how put/get wait on a full/empty queue (see WaitStrategy.h),
+// the try_ variants never wait.
+template <typename T, int SIZE, int MASK = SIZE - 1, typename WAIT = BusySpinWait>
 class alignas(128) SPSCQueue {
 public:
     static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE");
     void put(T *d) {
-        uint_fast64_t seq;
-        re:
-        seq = tail;
-        if (seq < (head.load(std::memory_order_acquire) + SIZE)) {
-            buf[seq & MASK] = *d;
-            tail.store(tail + 1, std::memory_order_release);
-        } else {
-            goto re;
-        }
+        not_full.wait([&] { return try_put(d); });
     }
 
     void get(T *d) {
-        uint_fast64_t seq;
-        re:
-        seq = head;
-        if (seq < tail.load(std::memory_order_acquire)) {
-            *d = buf[seq & MASK];
-            head.store(head + 1, std::memory_order_release);
-        } else {
-            goto re;
+        not_empty.wait([&] { return try_get(d); });
+    }
+
+    bool try_put(const T *d) {
+        auto seq = tail.load(std::memory_order_relaxed);
+        if (seq >= head_cache + SIZE) {
+            head_cache = head.load(std::memory_order_acquire);
+            if (seq >= head_cache + SIZE) return false;
+        }
+        buf[seq & MASK] = *d;
+        tail.store(seq + 1, std::memory_order_release);
+        not_empty.notify();
+        return true;
+    }
+
+    bool try_get(T *d) {
+        auto seq = head.load(std::memory_order_relaxed);
+        if (seq >= tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (seq >= tail_cache) return false;
+        }
+        *d = buf[seq & MASK];
+        head.store(seq + 1, std::memory_order_release);
+        not_full.notify();
+        return true;
+    }
+
+    // puts as many of the n items as fit, returns the count.
+    uint32_t try_put_n(const T *d, uint32_t n) {
+        auto seq = tail.load(std::memory_order_relaxed);
+        if (seq + n > head_cache + SIZE) {
+            head_cache = head.load(std::memory_order_acquire);
+        }
+        auto room = head_cache + SIZE - seq;
+        if (n > room) n = (uint32_t) room;
+        for (uint32_t idx = 0; idx < n; ++idx) {
+            buf[(seq + idx) & MASK] = d[idx];
         }
+        if (n > 0) {
+            tail.store(seq + n, std::memory_order_release);
+            not_empty.notify();
+        }
+        return n;
+    }
+
+    // gets up to n items, returns the count.
+    uint32_t try_get_n(T *d, uint32_t n) {
+        auto seq = head.load(std::memory_order_relaxed);
+        if (seq + n > tail_cache) {
+            tail_cache = tail.load(std::memory_order_acquire);
+        }
+        auto ava = tail_cache - seq;
+        if (n > ava) n = (uint32_t) ava;
+        for (uint32_t idx = 0; idx < n; ++idx) {
+            d[idx] = buf[(seq + idx) & MASK];
+        }
+        if (n > 0) {
+            head.store(seq + n, std::memory_order_release);
+            not_full.notify();
+        }
+        return n;
+    }
+
+    void put_n(const T *d, uint32_t n) {
+        not_full.wait([&] {
+            auto cnt = try_put_n(d, n);
+            d += cnt;
+            n -= cnt;
+            return n == 0;
+        });
+    }
+
+    void get_n(T *d, uint32_t n) {
+        not_empty.wait([&] {
+            auto cnt = try_get_n(d, n);
+            d += cnt;
+            n -= cnt;
+            return n == 0;
+        });
     }
 
 private:
-    alignas(128) std::atomic<uint64_t> head;
-    alignas(128) std::atomic<uint64_t> tail;
+    // consumer line
+    alignas(128) std::atomic<uint64_t> head{0};
+    uint64_t tail_cache = 0;
+    WAIT not_full;      // producer waits, consumer notifies
+    // producer line
+    alignas(128) std::atomic<uint64_t> tail{0};
+    uint64_t head_cache = 0;
+    WAIT not_empty;     // consumer waits, producer notifies
     alignas(128) T buf[SIZE];
 };
 
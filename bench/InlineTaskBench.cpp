@@ -0,0 +1,114 @@
+//
+// InlineTask<64> against std::function<void()>: the move/call/destroy
+// cycle a task goes through in a queue, for captures of 16, 48 and 96
+// bytes, then fork-join through BasicThreadPool with either as TASK.
+//
+//   g++ -std=c++17 -O2 -pthread -Iconcurrency -Iutil bench/InlineTaskBench.cpp -o task_bench
+//   ./task_bench [iterations, default 10000000]
+//
+// Heap allocations are counted by replacing operator new.
+//
+
+#include "InlineTask.h"
+#include "ThreadPool.h"
+#include "TaskGroup.h"
+
+#include <new>
+#include <array>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+static std::atomic<uint64_t> g_allocs{0};
+
+// gcc sees malloc behind new and free behind delete and warns on the pairing
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (auto ptr = malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+
+static volatile uint64_t g_sink = 0;
+
+typedef struct {
+    double ns;
+    double allocs;
+} result_t;
+
+// a ring of slots standing in for a queue: construct into one, move it to
+// the next, call and destroy there.
+template <typename TASK, size_t CAPTURE>
+static result_t cycle(uint64_t iters) {
+    std::vector<TASK> ring(1024);
+    std::array<uint64_t, CAPTURE / 8> cap{};
+    auto allocs = g_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t idx = 0; idx < iters; ++idx) {
+        cap[0] = idx;
+        auto &slot = ring[idx & 1023];
+        slot = TASK([cap] { g_sink = g_sink + cap[0] + cap[cap.size() - 1]; });
+        auto &next = ring[(idx + 1) & 1023];
+        next = std::move(slot);
+        next();
+        next = TASK();
+    }
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return {ns / iters, (double) (g_allocs.load() - allocs) / iters};
+}
+
+// one root task spawning iters children through a TaskGroup, so they go
+// through the workers' deques.
+template <typename TASK>
+static result_t fork_join(uint32_t workers, uint64_t iters) {
+    BasicThreadPool<FutexParkWait, TASK> pool;
+    pool.init(workers);
+    std::atomic<uint64_t> done{0};
+    auto allocs = g_allocs.load();
+    auto start = std::chrono::steady_clock::now();
+    auto root = pool.submit([&] {
+        TaskGroup<BasicThreadPool<FutexParkWait, TASK>> group(pool);
+        std::array<uint64_t, 4> cap{};
+        for (uint64_t idx = 0; idx < iters; ++idx) {
+            cap[0] = idx;
+            group.run([cap, &done] { done.fetch_add(cap[0] & 1, std::memory_order_relaxed); });
+        }
+        group.wait();
+    });
+    root.get();
+    auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    auto spent = g_allocs.load() - allocs;
+    pool.exit();
+    return {ns / iters, (double) spent / iters};
+}
+
+static void row(const char *name, result_t inl, result_t fun) {
+    printf("%-22s %10.1f %8.2f %12.1f %8.2f %8.2fx\n", name, inl.ns, inl.allocs, fun.ns, fun.allocs, fun.ns / inl.ns);
+}
+
+int main(int argc, char **argv) {
+    uint64_t iters = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+    typedef InlineTask<64> inline_t;
+    typedef std::function<void()> function_t;
+
+    printf("%-22s %10s %8s %12s %8s %9s\n", "ns/task, allocs/task", "inline", "allocs", "std::function", "allocs", "speedup");
+    row("cycle, 16B capture", cycle<inline_t, 16>(iters), cycle<function_t, 16>(iters));
+    row("cycle, 48B capture", cycle<inline_t, 48>(iters), cycle<function_t, 48>(iters));
+    row("cycle, 96B capture", cycle<inline_t, 96>(iters), cycle<function_t, 96>(iters));
+    auto workers = std::thread::hardware_concurrency();
+    if (workers == 0) workers = 1;
+    row("pool fork-join", fork_join<inline_t>(workers, iters / 10), fork_join<function_t>(workers, iters / 10));
+    return 0;
+}
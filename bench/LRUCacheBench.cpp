@@ -0,0 +1,75 @@
+//
+// LRUCache throughput from 1 to 32 threads for 1 to 256 shards, 90% get
+// and 10% put over a key space twice the capacity.
+//
+//   g++ -std=c++17 -O2 -pthread -Idata_struct bench/LRUCacheBench.cpp -o lru_bench
+//   ./lru_bench [operations per run, default 4000000]
+//
+// With one shard every thread meets on the same lock, the gap to the
+// wider columns is what sharding buys.
+//
+
+#include "LRUCache.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+enum { CAPACITY = 1 << 16, KEYS = CAPACITY * 2 };
+
+static std::atomic<uint64_t> g_sink{0};
+
+static const uint32_t g_shards[] = {1, 4, 16, 64, 256};
+
+// ops split over threads, returns million operations per second.
+static double run(uint32_t shards, uint32_t threads, uint64_t ops) {
+    LRUCache<uint64_t, uint64_t> cache;
+    if (!cache.init(CAPACITY, shards)) {
+        fprintf(stderr, "init failed\n");
+        exit(1);
+    }
+    for (uint64_t key = 0; key < CAPACITY; ++key) cache.put(key, key);
+
+    auto per_thread = ops / threads;
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t idx = 0; idx < threads; ++idx) {
+        workers.emplace_back([&cache, per_thread, idx] {
+            uint64_t seed = 0x9E3779B97F4A7C15ull * (idx + 1);
+            uint64_t value, sum = 0;
+            for (uint64_t num = 0; num < per_thread; ++num) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                auto key = seed % KEYS;
+                if (seed >> 60 == 0) {
+                    cache.put(key, num);
+                } else if (cache.get(key, &value)) {
+                    sum += value;
+                }
+            }
+            g_sink.fetch_add(sum, std::memory_order_relaxed);
+        });
+    }
+    for (auto &&th : workers) th.join();
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return per_thread * threads / secs / 1e6;
+}
+
+int main(int argc, char **argv) {
+    uint64_t ops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4000000;
+    printf("%u hardware threads, %llu ops, Mops/s by shard count\n",
+           std::thread::hardware_concurrency(), (unsigned long long) ops);
+    printf("%8s", "threads");
+    for (auto shards : g_shards) printf(" %9u", shards);
+    printf("\n");
+    for (uint32_t threads = 1; threads <= 32; threads *= 2) {
+        printf("%8u", threads);
+        for (auto shards : g_shards) printf(" %9.2f", run(shards, threads, ops));
+        printf("\n");
+    }
+    return 0;
+}
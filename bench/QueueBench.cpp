@@ -0,0 +1,116 @@
+//
+// Throughput of MPSCQueue and MPMCQueue from 1 to 32 producers against a
+// mutex guarded ring, with SPSCQueue as the single producer baseline.
+//
+//   g++ -std=c++17 -O2 -pthread -I. -Iconcurrency bench/QueueBench.cpp -o queue_bench
+//   ./queue_bench [items per run, default 4000000]
+//
+// Each row moves the same number of items from the producers to one
+// consumer (MPMC also with as many consumers as producers). Full or empty
+// queues yield rather than spin, so oversubscribed runs still finish.
+//
+
+#include "SPSCQueue.h"
+#include "MPSCQueue.h"
+#include "MPMCQueue.h"
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+enum { QUEUE_SIZE = 4096 };
+
+template <typename T, int SIZE>
+class MutexQueue {
+public:
+    bool try_put(const T *d) {
+        std::lock_guard<std::mutex> lg(m_mtx);
+        if (m_tail - m_head == SIZE) return false;
+        m_buf[m_tail++ % SIZE] = *d;
+        return true;
+    }
+
+    bool try_get(T *d) {
+        std::lock_guard<std::mutex> lg(m_mtx);
+        if (m_tail == m_head) return false;
+        *d = m_buf[m_head++ % SIZE];
+        return true;
+    }
+
+private:
+    std::mutex m_mtx;
+    uint64_t m_head = 0;
+    uint64_t m_tail = 0;
+    T m_buf[SIZE];
+};
+
+template <typename Q>
+static void put(Q *que, uint64_t val) {
+    while (!que->try_put(&val)) std::this_thread::yield();
+}
+
+template <typename Q>
+static uint64_t get(Q *que) {
+    uint64_t val;
+    while (!que->try_get(&val)) std::this_thread::yield();
+    return val;
+}
+
+// items split over producers, returns million items per second.
+template <typename Q>
+static double run(int producers, int consumers, uint64_t items) {
+    auto que = new Q();
+    auto per_prod = items / producers;
+    auto total = per_prod * producers;
+    auto per_cons = total / consumers;
+    std::vector<uint64_t> sums(consumers, 0);
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int idx = 0; idx < consumers; ++idx) {
+        auto cnt = per_cons + (idx == 0 ? total % consumers : 0);
+        threads.emplace_back([que, cnt, &sums, idx] {
+            uint64_t sum = 0;
+            for (uint64_t num = 0; num < cnt; ++num) sum += get(que);
+            sums[idx] = sum;
+        });
+    }
+    for (int idx = 0; idx < producers; ++idx) {
+        threads.emplace_back([que, per_prod] {
+            for (uint64_t num = 1; num <= per_prod; ++num) put(que, num);
+        });
+    }
+    for (auto &&th : threads) th.join();
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    delete que;
+
+    uint64_t sum = 0;
+    for (auto part : sums) sum += part;
+    if (sum != producers * (per_prod * (per_prod + 1) / 2)) {
+        fprintf(stderr, "lost items\n");
+        exit(1);
+    }
+    return total / secs / 1e6;
+}
+
+int main(int argc, char **argv) {
+    uint64_t items = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4000000;
+    printf("%u hardware threads, %llu items, Mops/s\n",
+           std::thread::hardware_concurrency(), (unsigned long long) items);
+    printf("%8s %10s %10s %10s %10s %10s\n", "threads", "spsc", "mpsc", "mpmc", "mpmc n:n", "mutex");
+    for (int num = 1; num <= 32; num *= 2) {
+        char spsc[16] = "-";
+        if (num == 1) {
+            snprintf(spsc, sizeof(spsc), "%.2f", run<SPSCQueue<uint64_t, QUEUE_SIZE>>(1, 1, items));
+        }
+        printf("%8d %10s %10.2f %10.2f %10.2f %10.2f\n", num, spsc,
+               run<MPSCQueue<uint64_t, QUEUE_SIZE>>(num, 1, items),
+               run<MPMCQueue<uint64_t, QUEUE_SIZE>>(num, 1, items),
+               run<MPMCQueue<uint64_t, QUEUE_SIZE>>(num, num, items),
+               run<MutexQueue<uint64_t, QUEUE_SIZE>>(num, 1, items));
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+//
+// TypeConverter parse/format and the fixed point pair against the
+// str2num/num2str stream path, for integers, doubles and prices.
+//
+//   g++ -std=c++17 -O2 -Iutil bench/TypeConverterBench.cpp -o conv_bench
+//   ./conv_bench [iterations, default 2000000]
+//
+
+#include "TypeConverter.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+static volatile uint64_t g_sink = 0;
+
+enum { SAMPLES = 1024 };
+
+template <typename FUNC>
+static double ns_per_op(uint64_t iters, FUNC &&func) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t idx = 0; idx < iters; ++idx) func(idx & (SAMPLES - 1));
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iters;
+}
+
+static void row(const char *name, double fast, double slow) {
+    printf("%-16s %10.1f %10.1f %8.2fx\n", name, fast, slow, slow / fast);
+}
+
+int main(int argc, char **argv) {
+    uint64_t iters = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+    std::vector<std::string> ints, reals, prices;
+    std::vector<int64_t> int_vals, fixed_vals;
+    std::vector<double> real_vals;
+    for (uint32_t idx = 0; idx < SAMPLES; ++idx) {
+        int64_t val = (int64_t) (idx * 2654435761u) - 2000000000;
+        int_vals.push_back(val);
+        ints.push_back(std::to_string(val));
+        real_vals.push_back(val / 1024.0);
+        reals.push_back(TypeConverter::num2str(val / 1024.0));
+        fixed_vals.push_back(val % 100000000);
+        char buf[32];
+        prices.emplace_back(buf, TypeConverter::format_fixed(buf, sizeof(buf), val % 100000000, 4));
+    }
+
+    printf("%-16s %10s %10s %9s\n", "ns/op", "charconv", "stream", "speedup");
+    row("parse int64", ns_per_op(iters, [&](uint32_t idx) {
+        int64_t val = 0;
+        TypeConverter::parse(ints[idx], &val);
+        g_sink = g_sink + val;
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::str2num<int64_t>(ints[idx]);
+    }));
+    row("parse double", ns_per_op(iters, [&](uint32_t idx) {
+        double val = 0;
+        TypeConverter::parse(reals[idx], &val);
+        g_sink = g_sink + (uint64_t) val;
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + (uint64_t) TypeConverter::str2num<double>(reals[idx]);
+    }));
+    row("parse fixed", ns_per_op(iters, [&](uint32_t idx) {
+        int64_t val = 0;
+        TypeConverter::parse_fixed(prices[idx], 4, &val);
+        g_sink = g_sink + val;
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + (int64_t) (TypeConverter::str2num<double>(prices[idx]) * 1e4);
+    }));
+
+    char buf[32];
+    row("format int64", ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::format(buf, sizeof(buf), int_vals[idx]);
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::num2str(int_vals[idx]).size();
+    }));
+    row("format double", ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::format(buf, sizeof(buf), real_vals[idx]);
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::num2str(real_vals[idx]).size();
+    }));
+    row("format fixed", ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::format_fixed(buf, sizeof(buf), fixed_vals[idx], 4);
+    }), ns_per_op(iters, [&](uint32_t idx) {
+        g_sink = g_sink + TypeConverter::num2str(fixed_vals[idx] / 1e4).size();
+    }));
+    return 0;
+}
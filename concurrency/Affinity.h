@@ -0,0 +1,249 @@
+#ifndef UTILS_AFFINITY_H
+#define UTILS_AFFINITY_H
+
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "log_std.h"
+
+enum {
+    AFFINITY_NONE,          // leave placement to the scheduler
+    AFFINITY_CPU_LIST,      // i-th thread on cpus[i % size]
+    AFFINITY_COMPACT,       // fill a node, core by core, before the next
+    AFFINITY_SCATTER,       // round robin over nodes, whole cores before siblings
+    AFFINITY_NUMA_NODE      // round robin over nodes, free within the node
+};
+
+typedef struct {
+    int cpu;
+    int core;
+    int package;
+    int node;
+    int sibling;            // 0 for the first hardware thread of its core
+} cpu_info_t;
+
+// Thread placement from the sysfs topology, limited to the CPUs this process
+// may run on. Any thread can use it: pools and loop groups through plan()
+// and apply(), a hand-rolled thread (say an SPSCQueue producer) through
+// pin_cpu() and set_name().
+class Affinity {
+public:
+    typedef struct {
+        cpu_set_t cpus;
+        int node;               // -1 when unpinned
+    } placement_t;
+
+    // where each of count threads should go.
+    static std::vector<placement_t> plan(int policy, uint32_t count,
+                                         const std::vector<int> &cpus={}) {
+        std::vector<placement_t> places(count);
+        for (auto &&place : places) {
+            CPU_ZERO(&place.cpus);
+            place.node = -1;
+        }
+        auto &topo = topology();
+        if (policy == AFFINITY_NONE || topo.empty()) return places;
+
+        if (policy == AFFINITY_NUMA_NODE) {
+            auto nodes = node_list();
+            for (uint32_t idx = 0; idx < count; ++idx) {
+                auto node = nodes[idx % nodes.size()];
+                for (auto &&info : topo) {
+                    if (info.node == node) CPU_SET(info.cpu, &places[idx].cpus);
+                }
+                places[idx].node = node;
+            }
+            return places;
+        }
+
+        std::vector<int> order;
+        if (policy == AFFINITY_CPU_LIST) {
+            for (auto cpu : cpus) {
+                if (valid_cpu(cpu)) order.push_back(cpu);
+            }
+        } else if (policy == AFFINITY_COMPACT) {
+            auto sorted = topo;
+            std::sort(sorted.begin(), sorted.end(), [](const cpu_info_t &l, const cpu_info_t &r) {
+                if (l.node != r.node) return l.node < r.node;
+                if (l.package != r.package) return l.package < r.package;
+                if (l.core != r.core) return l.core < r.core;
+                return l.cpu < r.cpu;
+            });
+            for (auto &&info : sorted) order.push_back(info.cpu);
+        } else if (policy == AFFINITY_SCATTER) {
+            order = scatter_order();
+        }
+        if (order.empty()) return places;
+        for (uint32_t idx = 0; idx < count; ++idx) {
+            auto cpu = order[idx % order.size()];
+            CPU_SET(cpu, &places[idx].cpus);
+            places[idx].node = node_of(cpu);
+        }
+        return places;
+    }
+
+    // pins the calling thread, an empty set is a no-op.
+    static bool apply(const placement_t &place) {
+        if (CPU_COUNT(&place.cpus) == 0) return true;
+        auto ret = pthread_setaffinity_np(pthread_self(), sizeof(place.cpus), &place.cpus);
+        if (ret != 0) {
+            SYS("set thread affinity error[%d]", ret);
+            return false;
+        }
+        return true;
+    }
+
+    static bool pin_cpu(int cpu) {
+        if (!valid_cpu(cpu)) return false;
+        placement_t place;
+        CPU_ZERO(&place.cpus);
+        CPU_SET(cpu, &place.cpus);
+        place.node = node_of(cpu);
+        return apply(place);
+    }
+
+    // names the calling thread "<prefix>-<idx>", cut to the 15 chars the
+    // kernel keeps; shows up in top -H, perf and gdb.
+    static void set_name(const char *prefix, uint32_t idx) {
+        if (!prefix) return;
+        char name[16];
+        snprintf(name, sizeof(name), "%s-%u", prefix, idx);
+        pthread_setname_np(pthread_self(), name);
+    }
+
+    static int node_of(int cpu) {
+        for (auto &&info : topology()) {
+            if (info.cpu == cpu) return info.node;
+        }
+        return 0;
+    }
+
+    static const std::vector<cpu_info_t> &topology() {
+        static std::vector<cpu_info_t> topo = load_topology();
+        return topo;
+    }
+
+private:
+    // CPU_SET past the end of a cpu_set_t writes out of bounds.
+    static bool valid_cpu(int cpu) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) return true;
+        SYS("cpu[%d] out of range", cpu);
+        return false;
+    }
+
+    static std::vector<int> node_list() {
+        std::vector<int> nodes;
+        for (auto &&info : topology()) {
+            if (std::find(nodes.begin(), nodes.end(), info.node) == nodes.end()) {
+                nodes.push_back(info.node);
+            }
+        }
+        std::sort(nodes.begin(), nodes.end());
+        return nodes;
+    }
+
+    // first hardware threads of every core before any sibling, and nodes
+    // taking turns at each step.
+    static std::vector<int> scatter_order() {
+        auto nodes = node_list();
+        std::vector<std::vector<cpu_info_t>> per_node(nodes.size());
+        for (auto &&info : topology()) {
+            auto pos = std::find(nodes.begin(), nodes.end(), info.node) - nodes.begin();
+            per_node[pos].push_back(info);
+        }
+        size_t most = 0;
+        for (auto &&cpus : per_node) {
+            std::sort(cpus.begin(), cpus.end(), [](const cpu_info_t &l, const cpu_info_t &r) {
+                if (l.sibling != r.sibling) return l.sibling < r.sibling;
+                if (l.package != r.package) return l.package < r.package;
+                if (l.core != r.core) return l.core < r.core;
+                return l.cpu < r.cpu;
+            });
+            most = std::max(most, cpus.size());
+        }
+        std::vector<int> order;
+        for (size_t idx = 0; idx < most; ++idx) {
+            for (auto &&cpus : per_node) {
+                if (idx < cpus.size()) order.push_back(cpus[idx].cpu);
+            }
+        }
+        return order;
+    }
+
+    static int read_int(const std::string &path, int dflt) {
+        auto fp = fopen(path.c_str(), "r");
+        if (!fp) return dflt;
+        int val;
+        if (fscanf(fp, "%d", &val) != 1) val = dflt;
+        fclose(fp);
+        return val;
+    }
+
+    // "0-3,8-11" style list.
+    static std::vector<int> read_list(const std::string &path) {
+        std::vector<int> cpus;
+        auto fp = fopen(path.c_str(), "r");
+        if (!fp) return cpus;
+        int lo, hi;
+        for (;;) {
+            if (fscanf(fp, "%d", &lo) != 1) break;
+            hi = lo;
+            auto ch = fgetc(fp);
+            if (ch == '-') {
+                if (fscanf(fp, "%d", &hi) != 1) break;
+                ch = fgetc(fp);
+            }
+            for (auto cpu = lo; cpu <= hi; ++cpu) cpus.push_back(cpu);
+            if (ch != ',') break;
+        }
+        fclose(fp);
+        return cpus;
+    }
+
+    static std::vector<cpu_info_t> load_topology() {
+        std::vector<cpu_info_t> topo;
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            SYS("sched_getaffinity error[%d]", errno);
+            return topo;
+        }
+        std::vector<int> node_of_cpu(CPU_SETSIZE, 0);
+        auto dp = opendir("/sys/devices/system/node");
+        if (dp) {
+            // no such directory without NUMA support, everything is node 0
+            while (auto ent = readdir(dp)) {
+                int node;
+                if (sscanf(ent->d_name, "node%d", &node) != 1) continue;
+                auto path = std::string("/sys/devices/system/node/") + ent->d_name + "/cpulist";
+                for (auto cpu : read_list(path)) {
+                    if (cpu < CPU_SETSIZE) node_of_cpu[cpu] = node;
+                }
+            }
+            closedir(dp);
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &allowed)) continue;
+            auto dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+            cpu_info_t info;
+            info.cpu = cpu;
+            info.core = read_int(dir + "core_id", cpu);
+            info.package = read_int(dir + "physical_package_id", 0);
+            info.node = node_of_cpu[cpu];
+            auto siblings = read_list(dir + "thread_siblings_list");
+            info.sibling = (int) (std::find(siblings.begin(), siblings.end(), cpu) - siblings.begin());
+            if (info.sibling == (int) siblings.size()) info.sibling = 0;
+            topo.push_back(info);
+        }
+        return topo;
+    }
+};
+
+#endif //UTILS_AFFINITY_H
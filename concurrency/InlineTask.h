@@ -0,0 +1,108 @@
+#ifndef UTILS_INLINETASK_H
+#define UTILS_INLINETASK_H
+
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+// Move-only void() callable stored in SIZE bytes of inline buffer. Callables
+// that fit (and are nothrow movable) never touch the heap; bigger ones fall
+// back to a single allocation. Unlike std::function the callable is never
+// copied, so move-only captures work too.
+template <size_t SIZE = 64>
+class InlineTask {
+public:
+    InlineTask() = default;
+
+    template <typename FUNC, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<FUNC>::type, InlineTask>::value>::type>
+    InlineTask(FUNC &&func) {
+        typedef typename std::decay<FUNC>::type func_t;
+        if constexpr (fits<func_t>()) {
+            new (m_buf) func_t(std::forward<FUNC>(func));
+            m_ops = &inline_ops<func_t>;
+        } else {
+            *(func_t**) m_buf = new func_t(std::forward<FUNC>(func));
+            m_ops = &heap_ops<func_t>;
+        }
+    }
+
+    InlineTask(InlineTask &&other) noexcept {
+        take(other);
+    }
+
+    InlineTask &operator=(InlineTask &&other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    InlineTask(const InlineTask&) = delete;
+    InlineTask &operator=(const InlineTask&) = delete;
+
+    ~InlineTask() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return m_ops != nullptr;
+    }
+
+    void operator()() {
+        m_ops->call(m_buf);
+    }
+
+    void reset() {
+        if (m_ops) {
+            m_ops->destroy(m_buf);
+            m_ops = nullptr;
+        }
+    }
+
+    // true when FUNC is stored without allocating.
+    template <typename FUNC>
+    static constexpr bool fits() {
+        return sizeof(FUNC) <= SIZE && alignof(FUNC) <= alignof(std::max_align_t)
+               && std::is_nothrow_move_constructible<FUNC>::value;
+    }
+
+private:
+    typedef struct {
+        void (*call)(void *buf);
+        void (*move)(void *dst, void *src);     // move-constructs dst, destroys src
+        void (*destroy)(void *buf);
+    } ops_t;
+
+    template <typename FUNC>
+    static constexpr ops_t inline_ops = {
+        [](void *buf) { (*(FUNC*) buf)(); },
+        [](void *dst, void *src) {
+            new (dst) FUNC(std::move(*(FUNC*) src));
+            ((FUNC*) src)->~FUNC();
+        },
+        [](void *buf) { ((FUNC*) buf)->~FUNC(); }
+    };
+
+    template <typename FUNC>
+    static constexpr ops_t heap_ops = {
+        [](void *buf) { (**(FUNC**) buf)(); },
+        [](void *dst, void *src) { *(FUNC**) dst = *(FUNC**) src; },
+        [](void *buf) { delete *(FUNC**) buf; }
+    };
+
+    void take(InlineTask &other) {
+        m_ops = other.m_ops;
+        if (m_ops) {
+            m_ops->move(m_buf, other.m_buf);
+            other.m_ops = nullptr;
+        }
+    }
+
+    const ops_t *m_ops = nullptr;
+    alignas(std::max_align_t) unsigned char m_buf[SIZE < sizeof(void*) ? sizeof(void*) : SIZE];
+};
+
+#endif //UTILS_INLINETASK_H
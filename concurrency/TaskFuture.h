@@ -0,0 +1,123 @@
+#ifndef UTILS_TASKFUTURE_H
+#define UTILS_TASKFUTURE_H
+
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <exception>
+#include <type_traits>
+
+// Result slot shared by a submitted task and its TaskFuture, freed by
+// whichever of the two lets go last. An exception from the task is kept
+// in place of the value.
+template <typename R>
+class TaskState {
+public:
+    typedef typename std::conditional<std::is_void<R>::value, char, R>::type value_t;
+
+    template <typename FUNC>
+    void run(FUNC &func) {
+        try {
+            if constexpr (std::is_void<R>::value) {
+                func();
+            } else {
+                m_value = func();
+            }
+        } catch (...) {
+            m_error = std::current_exception();
+        }
+        m_ready.store(true, std::memory_order_release);
+    }
+
+    bool ready() const {
+        return m_ready.load(std::memory_order_acquire);
+    }
+
+    value_t &value() {
+        return m_value;
+    }
+
+    const std::exception_ptr &error() const {
+        return m_error;
+    }
+
+    void release() {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+private:
+    std::atomic<uint32_t> m_refs{2};
+    std::atomic<bool> m_ready{false};
+    value_t m_value{};
+    std::exception_ptr m_error{};
+};
+
+// Move-only handle returned by ThreadPool::submit. get/wait run other
+// queued tasks of the pool while the result is not ready, so waiting from
+// inside a worker can not starve the pool.
+template <typename R>
+class TaskFuture {
+public:
+    typedef bool (*help_func_t)(void*);
+
+    TaskFuture() = default;
+
+    TaskFuture(TaskState<R> *state, help_func_t help_func, void *pool)
+        : m_state(state), m_help_func(help_func), m_pool(pool) {}
+
+    TaskFuture(TaskFuture &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    TaskFuture &operator=(TaskFuture &&other) noexcept {
+        if (this != &other) {
+            if (m_state) m_state->release();
+            m_state = other.m_state;
+            m_help_func = other.m_help_func;
+            m_pool = other.m_pool;
+            other.m_state = nullptr;
+        }
+        return *this;
+    }
+
+    TaskFuture(const TaskFuture&) = delete;
+    TaskFuture &operator=(const TaskFuture&) = delete;
+
+    ~TaskFuture() {
+        if (m_state) m_state->release();
+    }
+
+    bool valid() const {
+        return m_state != nullptr;
+    }
+
+    bool ready() const {
+        return m_state->ready();
+    }
+
+    void wait() const {
+        while (!m_state->ready()) {
+            if (!m_help_func(m_pool)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // once only, the value is moved out. Rethrows what the task threw.
+    R get() {
+        wait();
+        if (m_state->error()) std::rethrow_exception(m_state->error());
+        if constexpr (!std::is_void<R>::value) {
+            return std::move(m_state->value());
+        }
+    }
+
+private:
+    TaskState<R> *m_state = nullptr;
+    help_func_t m_help_func = nullptr;
+    void *m_pool = nullptr;
+};
+
+#endif //UTILS_TASKFUTURE_H
@@ -0,0 +1,132 @@
+#ifndef UTILS_TASKGROUP_H
+#define UTILS_TASKGROUP_H
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <exception>
+
+// Tasks run on POOL whose completion is awaited together. wait() runs
+// queued pool tasks on the calling thread until the group is done, so
+// groups may nest inside pool tasks. Must outlive its tasks (wait first).
+// A task that throws still counts as done, wait() rethrows the first
+// exception once every task has finished.
+template <typename POOL>
+class TaskGroup {
+public:
+    explicit TaskGroup(POOL &pool) : m_pool(pool) {}
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup &operator=(const TaskGroup&) = delete;
+
+    template <typename FUNC>
+    void run(FUNC &&func) {
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+        m_pool.add_task([this, func = std::forward<FUNC>(func)]() mutable {
+            try {
+                func();
+            } catch (...) {
+                std::lock_guard<std::mutex> lg(m_mtx);
+                if (!m_error) m_error = std::current_exception();
+            }
+            m_pending.fetch_sub(1, std::memory_order_release);
+        });
+    }
+
+    void wait() {
+        while (m_pending.load(std::memory_order_acquire) > 0) {
+            if (!m_pool.try_run_one()) {
+                std::this_thread::yield();
+            }
+        }
+        if (m_error) {
+            auto error = std::move(m_error);
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    POOL &pool() {
+        return m_pool;
+    }
+
+private:
+    POOL &m_pool;
+    std::atomic<size_t> m_pending{0};
+    std::mutex m_mtx;
+    std::exception_ptr m_error{};
+};
+
+// grain 0 picks about 8 chunks per worker.
+inline size_t auto_grain(size_t count, uint32_t workers, size_t grain) {
+    if (grain > 0) return grain;
+    grain = count / ((size_t) (workers ? workers : 1) * 8);
+    return grain > 0 ? grain : 1;
+}
+
+// halves [lo, hi) until at most grain long, handing the upper halves to
+// the pool, so idle workers steal big ranges first.
+template <typename POOL, typename FUNC>
+void split_range(TaskGroup<POOL> &group, size_t lo, size_t hi, size_t grain, FUNC &func) {
+    while (hi - lo > grain) {
+        auto mid = lo + (hi - lo) / 2;
+        group.run([&group, mid, hi, grain, &func] {
+            split_range(group, mid, hi, grain, func);
+        });
+        hi = mid;
+    }
+    func(lo, hi);
+}
+
+// func(lo, hi) over [begin, end) in chunks of at most grain, returns when
+// every chunk is done.
+template <typename POOL, typename FUNC>
+void parallel_for(POOL &pool, size_t begin, size_t end, size_t grain, FUNC &&func) {
+    if (begin >= end) return;
+    grain = auto_grain(end - begin, pool.size(), grain);
+    TaskGroup<POOL> group(pool);
+    try {
+        split_range(group, begin, end, grain, func);
+    } catch (...) {
+        // chunks already handed out still use func and group
+        try {
+            group.wait();
+        } catch (...) {}
+        throw;
+    }
+    group.wait();
+}
+
+// map(lo, hi) over chunks of [begin, end), results folded left to right
+// with reduce(acc, part) starting from init, so the result does not depend
+// on scheduling. T needs only to be copyable.
+template <typename POOL, typename T, typename MAP, typename REDUCE>
+T parallel_reduce(POOL &pool, size_t begin, size_t end, size_t grain,
+                  T init, MAP &&map, REDUCE &&reduce) {
+    if (begin >= end) return init;
+    grain = auto_grain(end - begin, pool.size(), grain);
+    auto chunks = (end - begin + grain - 1) / grain;
+    // a line per chunk: no false sharing, and no std::vector<bool> packing
+    // several chunks into one word
+    struct alignas(64) part_t {
+        T val;
+    };
+    std::vector<part_t> parts(chunks, part_t{init});
+    parallel_for(pool, 0, chunks, 1, [&](size_t lo, size_t hi) {
+        for (auto idx = lo; idx < hi; ++idx) {
+            auto from = begin + idx * grain;
+            auto to = from + grain < end ? from + grain : end;
+            parts[idx].val = map(from, to);
+        }
+    });
+    for (auto &&part : parts) {
+        init = reduce(init, part.val);
+    }
+    return init;
+}
+
+#endif //UTILS_TASKGROUP_H
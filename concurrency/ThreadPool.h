@@ -2,70 +2,265 @@
 #define UTILS_THREADPOOL_H
 
 #include <functional>
+#include <string>
 #include <thread>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
-#include <condition_variable>
+#include <atomic>
 
-class ThreadPool {
+#include "Affinity.h"
+#include "InlineTask.h"
+#include "TaskFuture.h"
+#include "WaitStrategy.h"
+#include "WorkDeque.h"
+
+// Work-stealing pool. A task added from one of the pool's own workers goes
+// to that worker's deque (LIFO for the owner, cache-warm), one added from
+// outside goes to the shared injection queue. An idle worker pops its own
+// deque, then the injection queue, then steals from a random victim.
+// WAIT decides how idle workers wait for tasks (see WaitStrategy.h):
+// spin on pinned low latency threads, park everywhere else.
+// TASK holds a queued callable, moved and never copied on its way through
+// the pool. Deque slots come from a per-thread node cache, so the default
+// InlineTask<64> makes add_task allocation free for typical lambdas.
+template <typename WAIT, typename TASK = InlineTask<64>>
+class BasicThreadPool {
 public:
+    typedef TASK task_t;
+    enum { MAX_CACHED = 1024 };
+
+    // before init: where workers run (see Affinity.h) and the thread name
+    // prefix. Thieves try victims on their own NUMA node first.
+    void set_affinity(int policy, const std::vector<int> &cpus={}) {
+        m_policy = policy;
+        m_cpus = cpus;
+    }
+
+    // copied, nullptr leaves the threads unnamed.
+    void set_name(const char *prefix) {
+        m_name = prefix ? prefix : "";
+    }
+
     void init(uint32_t size) {
         m_size = size;
+        auto places = Affinity::plan(m_policy, size, m_cpus);
         for (uint32_t idx = 0; idx < size; ++idx) {
-            m_thrds.emplace_back(std::thread(std::bind(&ThreadPool::exec_task, this)));
+            auto worker = new worker_t;
+            worker->pool = this;
+            worker->rng = 0x9E3779B97F4A7C15ull * (idx + 1);
+            worker->idx = idx;
+            worker->place = places[idx];
+            m_workers.push_back(worker);
+        }
+        for (uint32_t idx = 0; idx < size; ++idx) {
+            m_thrds.emplace_back(std::thread(std::bind(&BasicThreadPool::exec_task, this, m_workers[idx])));
         }
     }
 
+    // queued tasks, including ones they spawn, still run before exit returns.
     void exit() {
-        {
-            std::lock_guard<std::mutex> lg(m_mtx);
-            m_is_stop = true;
-        }
+        m_is_stop.store(true, std::memory_order_release);
+        m_wait.notify_all();
 
         for (auto &&thrd : m_thrds) {
             if (thrd.joinable()) {
                 thrd.join();
             }
         }
+        m_thrds.clear();
+        for (auto worker : m_workers) {
+            delete worker;
+        }
+        m_workers.clear();
     }
 
-    void add_task(std::function<void()> &&task) {
+    template <typename FUNC>
+    void add_task(FUNC &&func) {
         if (m_size == 0) {
-            task();
+            func();
             return;
         }
 
-        {
+        auto self = local_worker();
+        if (self && self->pool == this) {
+            self->deque.push(new_task(std::forward<FUNC>(func)));
+        } else {
             std::lock_guard<std::mutex> lg(m_mtx);
-            m_tasks.emplace(task);
+            m_inject.emplace_back(std::forward<FUNC>(func));
+            m_pending.store(m_inject.size(), std::memory_order_release);
+        }
+        m_wait.notify();
+    }
+
+    // add_task with a result, see TaskFuture.
+    template <typename FUNC>
+    TaskFuture<decltype(std::declval<FUNC&>()())> submit(FUNC &&func) {
+        typedef decltype(std::declval<FUNC&>()()) result_t;
+        auto state = new TaskState<result_t>();
+        add_task([state, func = std::forward<FUNC>(func)]() mutable {
+            state->run(func);
+            state->release();
+        });
+        return TaskFuture<result_t>(state, &BasicThreadPool::help, this);
+    }
+
+    // runs one queued task on the calling thread, false if none was found.
+    // Lets a thread waiting for pool work help instead of blocking.
+    bool try_run_one() {
+        task_t *task;
+        auto self = local_worker();
+        if (self && self->pool == this) {
+            task = find_task(self);
+        } else {
+            static thread_local uint64_t rng = 0x9E3779B97F4A7C15ull ^ (uintptr_t) &rng;
+            task = pop_inject();
+            if (!task) task = steal_task(nullptr, rng);
         }
-        m_cond.notify_one();
+        if (!task) return false;
+        run_task(task);
+        return true;
+    }
+
+    uint32_t size() const {
+        return m_size;
     }
 
-    void exec_task() {
-        std::unique_lock<std::mutex> ul(m_mtx);
+private:
+    struct worker_t {
+        WorkDeque<task_t> deque;
+        BasicThreadPool *pool;
+        uint64_t rng;
+        uint32_t idx;
+        Affinity::placement_t place;
+    };
+
+    static worker_t *&local_worker() {
+        static thread_local worker_t *worker = nullptr;
+        return worker;
+    }
+
+    void exec_task(worker_t *self) {
+        Affinity::apply(self->place);
+        Affinity::set_name(m_name.empty() ? nullptr : m_name.c_str(), self->idx);
+        local_worker() = self;
+        task_t *task = nullptr;
         for (;;) {
-            if (!m_tasks.empty()) {
-                auto task = m_tasks.front();
-                m_tasks.pop();
-                ul.unlock();
-                task();
-                ul.lock();
-            } else if (m_is_stop) {
-                break;
-            } else {
-                m_cond.wait(ul);
+            m_wait.wait([&] {
+                task = find_task(self);
+                return task || m_is_stop.load(std::memory_order_acquire);
+            });
+            if (!task) {
+                // stopping, but finish what is queued
+                task = find_task(self);
+                if (!task) break;
             }
+            run_task(task);
         }
+        local_worker() = nullptr;
     }
 
-private:
-    bool m_is_stop = false;
+    static void run_task(task_t *task) {
+        (*task)();
+        delete_task(task);
+    }
+
+    struct task_cache_t {
+        std::vector<void*> nodes;
+
+        ~task_cache_t() {
+            for (auto node : nodes) {
+                ::operator delete(node);
+            }
+        }
+    };
+
+    static task_cache_t &local_cache() {
+        static thread_local task_cache_t cache;
+        return cache;
+    }
+
+    template <typename FUNC>
+    static task_t *new_task(FUNC &&func) {
+        auto &nodes = local_cache().nodes;
+        void *node;
+        if (nodes.empty()) {
+            node = ::operator new(sizeof(task_t));
+        } else {
+            node = nodes.back();
+            nodes.pop_back();
+        }
+        return new (node) task_t(std::forward<FUNC>(func));
+    }
+
+    static void delete_task(task_t *task) {
+        task->~task_t();
+        auto &nodes = local_cache().nodes;
+        if (nodes.size() < MAX_CACHED) {
+            nodes.push_back(task);
+        } else {
+            ::operator delete(task);
+        }
+    }
+
+    static bool help(void *pool) {
+        return ((BasicThreadPool*) pool)->try_run_one();
+    }
+
+    task_t *find_task(worker_t *self) {
+        auto task = self->deque.pop();
+        if (task) return task;
+        task = pop_inject();
+        if (task) return task;
+        return steal_task(self, self->rng);
+    }
+
+    // polled by idle workers, m_pending keeps them off the mutex.
+    task_t *pop_inject() {
+        if (m_pending.load(std::memory_order_acquire) == 0) return nullptr;
+        std::lock_guard<std::mutex> lg(m_mtx);
+        if (m_inject.empty()) return nullptr;
+        auto task = new_task(std::move(m_inject.front()));
+        m_inject.pop_front();
+        m_pending.store(m_inject.size(), std::memory_order_release);
+        return task;
+    }
+
+    // one pass over the other workers from a random start, those on the
+    // thief's NUMA node first when workers are pinned.
+    task_t *steal_task(worker_t *self, uint64_t &rng) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        auto size = (uint32_t) m_workers.size();
+        if (size == 0) return nullptr;
+        auto start = (uint32_t) (rng % size);
+        auto node = self ? self->place.node : -1;
+        for (int pass = node < 0 ? 1 : 0; pass < 2; ++pass) {
+            for (uint32_t idx = 0; idx < size; ++idx) {
+                auto victim = m_workers[(start + idx) % size];
+                if (victim == self) continue;
+                if (node >= 0 && (victim->place.node == node) != (pass == 0)) continue;
+                auto task = victim->deque.steal();
+                if (task) return task;
+            }
+        }
+        return nullptr;
+    }
+
+    std::atomic<bool> m_is_stop{false};
     uint32_t m_size = 0;
+    int m_policy = AFFINITY_NONE;
+    std::vector<int> m_cpus;
+    std::string m_name = "pool";
+    std::atomic<size_t> m_pending{0};
     std::mutex m_mtx;
-    std::queue<std::function<void()>> m_tasks;
+    std::deque<task_t> m_inject;
+    std::vector<worker_t*> m_workers;
     std::vector<std::thread> m_thrds;
-    std::condition_variable m_cond;
+    WAIT m_wait;
 };
 
+typedef BasicThreadPool<FutexParkWait> ThreadPool;
+
 #endif //UTILS_THREADPOOL_H
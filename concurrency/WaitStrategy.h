@@ -0,0 +1,157 @@
+#ifndef UTILS_WAITSTRATEGY_H
+#define UTILS_WAITSTRATEGY_H
+
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Wait strategies for queues and pools, chosen per instance as a template
+// parameter. The waiting side calls wait(ready) with a predicate that
+// retries the operation, the other side calls notify() after publishing.
+// Only FutexParkWait does anything in notify, and only when a waiter is
+// parked, so the spinning strategies cost the producer nothing.
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// lowest latency, owns a core.
+class BusySpinWait {
+public:
+    template <typename PRED>
+    void wait(PRED &&ready) {
+        while (!ready()) {}
+    }
+
+    void notify() {}
+    void notify_all() {}
+};
+
+// pause between polls, doubling up to MAX_PAUSE, to spare the sibling
+// hyperthread and the cache line being polled.
+class PauseBackoffWait {
+public:
+    enum { MAX_PAUSE = 64 };
+
+    template <typename PRED>
+    void wait(PRED &&ready) {
+        uint32_t pause = 1;
+        while (!ready()) {
+            for (uint32_t idx = 0; idx < pause; ++idx) {
+                cpu_relax();
+            }
+            if (pause < MAX_PAUSE) pause <<= 1;
+        }
+    }
+
+    void notify() {}
+    void notify_all() {}
+};
+
+// spins briefly, then gives the core away between polls.
+class YieldWait {
+public:
+    enum { SPIN = 128 };
+
+    template <typename PRED>
+    void wait(PRED &&ready) {
+        for (uint32_t idx = 0; idx < SPIN; ++idx) {
+            if (ready()) return;
+            cpu_relax();
+        }
+        while (!ready()) {
+            std::this_thread::yield();
+        }
+    }
+
+    void notify() {}
+    void notify_all() {}
+};
+
+// spins briefly, then sleeps on a futex. notify only enters the kernel
+// when somebody is parked.
+//
+// The waiter must see the publish or the notifier the waiter count, which
+// needs a store-load barrier on both sides. The parking side pays for it
+// with membarrier(2), forcing one on every running thread of the process,
+// so notify gets by with a compiler barrier. Kernels without expedited
+// membarrier (< 4.14) get a fence in notify instead.
+class FutexParkWait {
+public:
+    enum { SPIN = 256 };
+
+    template <typename PRED>
+    void wait(PRED &&ready) {
+        for (uint32_t idx = 0; idx < SPIN; ++idx) {
+            if (ready()) return;
+            cpu_relax();
+        }
+        for (;;) {
+            auto seq = m_seq.load(std::memory_order_acquire);
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            heavy_fence();
+            if (ready()) {
+                m_waiters.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+            // returns at once if notify bumped m_seq after the load above
+            syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, seq, nullptr, nullptr, 0);
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+            if (ready()) return;
+        }
+    }
+
+    void notify() {
+        wake(1);
+    }
+
+    void notify_all() {
+        wake(INT_MAX);
+    }
+
+private:
+    static bool asymmetric() {
+        static const bool ok = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+        return ok;
+    }
+
+    static void heavy_fence() {
+        if (asymmetric()) {
+            syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void wake(int cnt) {
+        if (asymmetric()) {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        if (m_waiters.load(std::memory_order_relaxed) == 0) return;
+        m_seq.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, cnt, nullptr, nullptr, 0);
+    }
+
+    std::atomic<uint32_t> m_seq{0};
+    std::atomic<uint32_t> m_waiters{0};
+};
+
+#endif //UTILS_WAITSTRATEGY_H
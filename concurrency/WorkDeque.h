@@ -0,0 +1,115 @@
+#ifndef UTILS_WORKDEQUE_H
+#define UTILS_WORKDEQUE_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+// Chase-Lev work-stealing deque of T*. The owner thread pushes and pops at
+// the bottom, any thread steals from the top. The ring doubles when full;
+// replaced rings stay allocated until the deque is destroyed since a thief
+// may still be reading one. cap must be a power of two.
+template <typename T>
+class WorkDeque {
+public:
+    explicit WorkDeque(int64_t cap=256) {
+        m_ring.store(new ring_t(cap), std::memory_order_relaxed);
+    }
+
+    WorkDeque(const WorkDeque&) = delete;
+    WorkDeque &operator=(const WorkDeque&) = delete;
+
+    ~WorkDeque() {
+        delete m_ring.load(std::memory_order_relaxed);
+        for (auto ring : m_retired) {
+            delete ring;
+        }
+    }
+
+    // owner only.
+    void push(T *item) {
+        auto b = m_bottom.load(std::memory_order_relaxed);
+        auto t = m_top.load(std::memory_order_acquire);
+        auto ring = m_ring.load(std::memory_order_relaxed);
+        if (b - t > ring->cap - 1) {
+            ring = grow(ring, b, t);
+        }
+        ring->put(b, item);
+        m_bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // owner only, newest first. nullptr when empty.
+    T *pop() {
+        auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+        auto ring = m_ring.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto item = ring->get(b);
+        if (t == b) {
+            // last item, race the thieves for it
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // any thread, oldest first. nullptr when empty or another thief won.
+    T *steal() {
+        auto t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        auto item = m_ring.load(std::memory_order_acquire)->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    bool empty() const {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct ring_t {
+        int64_t cap;
+        std::atomic<T*> *buf;
+
+        explicit ring_t(int64_t size) : cap(size), buf(new std::atomic<T*>[size]) {}
+        ~ring_t() { delete[] buf; }
+
+        T *get(int64_t idx) const {
+            return buf[idx & (cap - 1)].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t idx, T *item) {
+            buf[idx & (cap - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    ring_t *grow(ring_t *ring, int64_t b, int64_t t) {
+        auto bigger = new ring_t(ring->cap * 2);
+        for (auto idx = t; idx < b; ++idx) {
+            bigger->put(idx, ring->get(idx));
+        }
+        m_retired.push_back(ring);
+        m_ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    alignas(64) std::atomic<int64_t> m_top{0};
+    alignas(64) std::atomic<int64_t> m_bottom{0};
+    std::atomic<ring_t*> m_ring{nullptr};
+    std::vector<ring_t*> m_retired{};
+};
+
+#endif //UTILS_WORKDEQUE_H
@@ -0,0 +1,305 @@
+#ifndef UTILS_LRUCACHE_H
+#define UTILS_LRUCACHE_H
+
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include "LinkedList.h"
+
+// Thread-safe LRU map split into independently locked shards by key hash,
+// so threads touching different keys rarely meet on a lock. Each shard has
+// a fixed slab of entries, an open-addressing index over them and an
+// IntrusiveList for recency; after init nothing allocates except K and V
+// themselves. Entries go when the shard is over its share of capacity or
+// of max_bytes, and, with a ttl, when found expired (or on purge).
+// K and V must be default constructible and copy assignable.
+template <typename K, typename V, typename HASH = std::hash<K>>
+class LRUCache {
+public:
+    typedef std::chrono::steady_clock steady_clock_t;
+
+    typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;         // to make room
+        uint64_t expirations;       // past their ttl
+    } stats_t;
+
+    LRUCache() = default;
+    LRUCache(const LRUCache &) = delete;
+    LRUCache &operator=(const LRUCache &) = delete;
+
+    // capacity entries over shards (rounded up to a power of 2, at most
+    // 65536). max_bytes 0 is no memory bound, ttl_ms 0 is no expiry. False
+    // when already inited or one shard would get over 2^30 entries.
+    bool init(uint32_t capacity, uint32_t shards=16, uint64_t max_bytes=0, uint32_t ttl_ms=0) {
+        if (m_shards || capacity == 0 || shards == 0) return false;
+        if (shards > MAX_SHARDS) shards = MAX_SHARDS;
+        uint32_t shard_num = 1;
+        uint32_t shard_bits = 0;
+        while (shard_num < shards && shard_num < capacity) {
+            shard_num <<= 1;
+            ++shard_bits;
+        }
+        auto per_cap = capacity / shard_num + (capacity % shard_num != 0);
+        if (per_cap > MAX_SHARD_CAP) return false;
+        m_shard_num = shard_num;
+        m_shard_bits = shard_bits;
+        m_ttl_ms = ttl_ms;
+        m_shards = new shard_t[m_shard_num];
+        auto per_bytes = max_bytes / m_shard_num + (max_bytes % m_shard_num != 0);
+        for (uint32_t idx = 0; idx < m_shard_num; ++idx) {
+            m_shards[idx].init(per_cap, per_bytes);
+        }
+        return true;
+    }
+
+    void exit() {
+        delete[] m_shards;
+        m_shards = nullptr;
+        m_shard_num = 0;
+    }
+
+    // copies the value out and makes the entry most recent.
+    bool get(const K &key, V *value) {
+        auto hash = hash_of(key);
+        auto &shard = shard_of(hash);
+        std::lock_guard<std::mutex> lg(shard.mtx);
+        auto pos = shard.find(slot_hash(hash), key);
+        if (pos == NPOS) {
+            ++shard.stats.misses;
+            return false;
+        }
+        auto entry = &shard.entries[shard.slots[pos].idx - 1];
+        if (m_ttl_ms && entry->expire_ms <= now_ms()) {
+            shard.remove(pos);
+            ++shard.stats.expirations;
+            ++shard.stats.misses;
+            return false;
+        }
+        shard.lru.move_to_head(entry);
+        *value = entry->value;
+        ++shard.stats.hits;
+        return true;
+    }
+
+    // inserts or replaces. bytes is what the entry counts against
+    // max_bytes, 0 for sizeof(K) + sizeof(V). False when it can never fit.
+    bool put(const K &key, const V &value, size_t bytes=0) {
+        if (bytes == 0) bytes = sizeof(K) + sizeof(V);
+        auto hash = hash_of(key);
+        auto &shard = shard_of(hash);
+        if (shard.max_bytes && bytes > shard.max_bytes) return false;
+        auto expire = m_ttl_ms ? now_ms() + m_ttl_ms : 0;
+
+        std::lock_guard<std::mutex> lg(shard.mtx);
+        auto pos = shard.find(slot_hash(hash), key);
+        entry_t *entry;
+        if (pos != NPOS) {
+            entry = &shard.entries[shard.slots[pos].idx - 1];
+            shard.bytes -= entry->bytes;
+            shard.lru.move_to_head(entry);
+        } else {
+            entry = nullptr;
+        }
+        while (shard.max_bytes && shard.bytes + bytes > shard.max_bytes) {
+            auto last = shard.lru.tail();
+            if (last == entry) last = shard.lru.prev(last);
+            shard.remove(shard.locate(last));
+            ++shard.stats.evictions;
+        }
+        if (!entry) {
+            if (shard.free.empty()) {
+                shard.remove(shard.locate(shard.lru.tail()));
+                ++shard.stats.evictions;
+            }
+            entry = shard.free.pop_head();
+            entry->key = key;
+            entry->hash = slot_hash(hash);
+            shard.insert(entry);
+            shard.lru.put_head(entry);
+        }
+        entry->value = value;
+        entry->bytes = bytes;
+        entry->expire_ms = expire;
+        shard.bytes += bytes;
+        return true;
+    }
+
+    bool erase(const K &key) {
+        auto hash = hash_of(key);
+        auto &shard = shard_of(hash);
+        std::lock_guard<std::mutex> lg(shard.mtx);
+        auto pos = shard.find(slot_hash(hash), key);
+        if (pos == NPOS) return false;
+        shard.remove(pos);
+        return true;
+    }
+
+    // drops every expired entry, returns how many.
+    size_t purge() {
+        if (!m_ttl_ms) return 0;
+        size_t count = 0;
+        auto now = now_ms();
+        for (uint32_t idx = 0; idx < m_shard_num; ++idx) {
+            auto &shard = m_shards[idx];
+            std::lock_guard<std::mutex> lg(shard.mtx);
+            for (auto entry = shard.lru.tail(); entry;) {
+                auto prev = shard.lru.prev(entry);
+                if (entry->expire_ms <= now) {
+                    shard.remove(shard.locate(entry));
+                    ++shard.stats.expirations;
+                    ++count;
+                }
+                entry = prev;
+            }
+        }
+        return count;
+    }
+
+    size_t size() const {
+        size_t count = 0;
+        for (uint32_t idx = 0; idx < m_shard_num; ++idx) {
+            std::lock_guard<std::mutex> lg(m_shards[idx].mtx);
+            count += m_shards[idx].lru.size();
+        }
+        return count;
+    }
+
+    stats_t stats() const {
+        stats_t sum{};
+        for (uint32_t idx = 0; idx < m_shard_num; ++idx) {
+            std::lock_guard<std::mutex> lg(m_shards[idx].mtx);
+            auto &part = m_shards[idx].stats;
+            sum.hits += part.hits;
+            sum.misses += part.misses;
+            sum.evictions += part.evictions;
+            sum.expirations += part.expirations;
+        }
+        return sum;
+    }
+
+    ~LRUCache() {
+        exit();
+    }
+
+private:
+    enum : uint32_t { NPOS = 0xFFFFFFFF };
+
+    // the shard is picked by the top 16 hash bits, slot_hash takes the 32
+    // below, so more shards would reuse bits the index probes on.
+    enum : uint32_t { MAX_SHARDS = 1u << 16 };
+
+    // keeps a shard's slot table (twice its entries) and positions below NPOS.
+    enum : uint32_t { MAX_SHARD_CAP = 1u << 30 };
+
+    struct entry_t : ListHook<entry_t> {
+        K key{};
+        V value{};
+        uint32_t hash = 0;
+        size_t bytes = 0;
+        int64_t expire_ms = 0;
+    };
+
+    typedef struct {
+        uint32_t hash;
+        uint32_t idx;               // entry + 1, 0 is an empty slot
+    } slot_t;
+
+    struct alignas(64) shard_t {
+        void init(uint32_t cap, uint64_t max) {
+            max_bytes = max;
+            entries.resize(cap);
+            uint32_t num = 1;
+            while (num < (uint64_t) cap * 2) num <<= 1;
+            slots.assign(num, slot_t{0, 0});
+            mask = num - 1;
+            lru.init();
+            free.init();
+            for (auto &&entry : entries) {
+                free.put_tail(&entry);
+            }
+        }
+
+        // linear probing, the table is at most half full.
+        uint32_t find(uint32_t hash, const K &key) const {
+            for (auto pos = hash & mask;; pos = (pos + 1) & mask) {
+                auto &slot = slots[pos];
+                if (slot.idx == 0) return NPOS;
+                if (slot.hash == hash && entries[slot.idx - 1].key == key) return pos;
+            }
+        }
+
+        uint32_t locate(entry_t *entry) const {
+            auto idx = (uint32_t) (entry - entries.data()) + 1;
+            for (auto pos = entry->hash & mask;; pos = (pos + 1) & mask) {
+                if (slots[pos].idx == idx) return pos;
+            }
+        }
+
+        void insert(entry_t *entry) {
+            auto pos = entry->hash & mask;
+            while (slots[pos].idx != 0) pos = (pos + 1) & mask;
+            slots[pos] = {entry->hash, (uint32_t) (entry - entries.data()) + 1};
+        }
+
+        // frees the entry and closes the gap by shifting back the slots
+        // that probed past it, so no tombstones build up.
+        void remove(uint32_t pos) {
+            auto entry = &entries[slots[pos].idx - 1];
+            lru.unlink(entry);
+            bytes -= entry->bytes;
+            entry->key = K{};
+            entry->value = V{};
+            free.put_head(entry);
+
+            auto hole = pos;
+            for (auto next = (hole + 1) & mask; slots[next].idx != 0; next = (next + 1) & mask) {
+                auto home = slots[next].hash & mask;
+                if (((next - home) & mask) >= ((next - hole) & mask)) {
+                    slots[hole] = slots[next];
+                    hole = next;
+                }
+            }
+            slots[hole] = {0, 0};
+        }
+
+        mutable std::mutex mtx;
+        std::vector<entry_t> entries;
+        std::vector<slot_t> slots;
+        uint32_t mask = 0;
+        IntrusiveList<entry_t> lru;         // most recent at head
+        IntrusiveList<entry_t> free;
+        uint64_t bytes = 0;
+        uint64_t max_bytes = 0;
+        stats_t stats{};
+    };
+
+    uint64_t hash_of(const K &key) const {
+        return (uint64_t) HASH()(key) * 0x9E3779B97F4A7C15ull;
+    }
+
+    // top bits pick the shard, the 32 below them index within it.
+    static uint32_t slot_hash(uint64_t hash) {
+        return (uint32_t) (hash >> 16);
+    }
+
+    shard_t &shard_of(uint64_t hash) const {
+        return m_shards[m_shard_bits ? hash >> (64 - m_shard_bits) : 0];
+    }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            steady_clock_t::now().time_since_epoch()).count();
+    }
+
+    shard_t *m_shards = nullptr;
+    uint32_t m_shard_num = 0;
+    uint32_t m_shard_bits = 0;
+    uint32_t m_ttl_ms = 0;
+};
+
+#endif //UTILS_LRUCACHE_H
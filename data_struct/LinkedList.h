@@ -1,118 +1,407 @@
 #ifndef UTILS_LINKEDLIST_H
 #define UTILS_LINKEDLIST_H
 
+#include <new>
+#include <cstddef>
 #include <cstdint>
+#include <tuple>
+#include <utility>
+#include <type_traits>
 
 template <typename T>
 struct LinkedNode {
+    // not for a lone LinkedNode, copying one from a non-const lvalue goes
+    // to the copy constructor instead of constructing elem from it.
+    template <typename... ARGS, typename std::enable_if<
+        !std::is_same<std::tuple<typename std::decay<ARGS>::type...>, std::tuple<LinkedNode>>::value, int>::type = 0>
+    explicit LinkedNode(ARGS&&... args) : elem(std::forward<ARGS>(args)...), next(nullptr), prev(nullptr) {}
+
     T elem;
     struct LinkedNode *next;
     struct LinkedNode *prev;
 };
 
-template <typename T>
-class LinkedList {
+// Base of an element kept in IntrusiveList, one per list it can be in:
+//     struct Session : ListHook<Session>, ListHook<Session, timer_tag> {...};
+template <typename T, typename TAG = void>
+struct ListHook {
+    T *next = nullptr;
+    T *prev = nullptr;
+};
+
+template <typename NODE>
+struct NodeLinks {
+    static NODE *&next(NODE *node) {
+        return node->next;
+    }
+
+    static NODE *&prev(NODE *node) {
+        return node->prev;
+    }
+};
+
+template <typename T, typename TAG>
+struct HookLinks {
+    static T *&next(T *node) {
+        return static_cast<ListHook<T, TAG>*>(node)->next;
+    }
+
+    static T *&prev(T *node) {
+        return static_cast<ListHook<T, TAG>*>(node)->prev;
+    }
+};
+
+// Doubly linked list over nodes that carry their own links, LINKS says
+// where they are. Every operation is O(1) and none allocates.
+template <typename NODE, typename LINKS>
+class ListBase {
 public:
-    void init() {
-        m_head = m_tail = nullptr;
-        m_size = 0;
+    void move_to_head(NODE *node) {
+        if (node == m_head) return;
+        unlink_node(node);
+        link_head(node);
     }
 
-    void exit() {
-        auto last = m_head;
-        while (last) {
-            auto node = last->next;
-            free(last);
-            last = node;
-        }
+    void move_to_tail(NODE *node) {
+        if (node == m_tail) return;
+        unlink_node(node);
+        link_tail(node);
     }
 
-    void put_tail(const T &elem) {
-        auto node = (LinkedNode<T>*) malloc(sizeof(LinkedNode<T>));
-        node->elem = elem;
-        node->next = nullptr;
+    NODE *prev(NODE *node) const {
+        return LINKS::prev(node);
+    }
 
-        if (m_size > 0) {
-            m_tail->next = node;
-            node->prev = m_tail;
-            m_tail = node;
+    NODE *next(NODE *node) const {
+        return LINKS::next(node);
+    }
+
+    NODE *head() const {
+        return m_head;
+    }
+
+    NODE *tail() const {
+        return m_tail;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    uint32_t size() const {
+        return m_size;
+    }
+
+protected:
+    void reset() {
+        m_head = m_tail = nullptr;
+        m_size = 0;
+    }
+
+    void link_head(NODE *node) {
+        LINKS::prev(node) = nullptr;
+        LINKS::next(node) = m_head;
+        if (m_head) {
+            LINKS::prev(m_head) = node;
         } else {
-            node->prev = nullptr;
-            m_tail = m_head = node;
+            m_tail = node;
         }
+        m_head = node;
         ++m_size;
     }
 
-    void put_head(const T &elem) {
-        auto node = (LinkedNode<T>*) malloc(sizeof(LinkedNode<T>));
-        node->elem = elem;
-        node->prev = nullptr;
-
-        if (m_size > 0) {
-            m_head->prev = node;
-            node->next = m_head;
-            m_head = node;
+    void link_tail(NODE *node) {
+        LINKS::next(node) = nullptr;
+        LINKS::prev(node) = m_tail;
+        if (m_tail) {
+            LINKS::next(m_tail) = node;
         } else {
-            node->next = nullptr;
-            m_tail = m_head = node;
+            m_head = node;
         }
+        m_tail = node;
         ++m_size;
     }
 
-    void del_head() {
-        --m_size;
-        if (m_size > 0) {
-            auto node = m_head->next;
-            free(m_head);
-            node->prev = nullptr;
-            m_head = node;
+    void unlink_node(NODE *node) {
+        auto prev = LINKS::prev(node);
+        auto next = LINKS::next(node);
+        if (prev) {
+            LINKS::next(prev) = next;
         } else {
-            free(m_head);
-            m_head = m_tail = nullptr;
+            m_head = next;
         }
+        if (next) {
+            LINKS::prev(next) = prev;
+        } else {
+            m_tail = prev;
+        }
+        LINKS::next(node) = LINKS::prev(node) = nullptr;
+        --m_size;
     }
 
-    void del_tail() {
-        --m_size;
-        if (m_size > 0) {
-            auto node = m_tail->prev;
-            free(m_tail);
-            node->next = nullptr;
-            m_tail = node;
+    // other's nodes after ours, other is left empty.
+    void splice_tail(ListBase &other) {
+        if (other.m_size == 0 || &other == this) return;
+        if (m_tail) {
+            LINKS::next(m_tail) = other.m_head;
+            LINKS::prev(other.m_head) = m_tail;
         } else {
-            free(m_tail);
-            m_head = m_tail = nullptr;
+            m_head = other.m_head;
         }
+        m_tail = other.m_tail;
+        m_size += other.m_size;
+        other.reset();
     }
 
-    struct LinkedNode<T> *prev(struct LinkedNode<T> *node) const {
-        return node->prev;
+    uint32_t m_size = 0;
+    NODE *m_head = nullptr;
+    NODE *m_tail = nullptr;
+};
+
+// Links elements that derive from ListHook<T, TAG>, owns nothing. Handy for
+// LRU orders and timer lists, where the element already lives elsewhere.
+template <typename T, typename TAG = void>
+class IntrusiveList : public ListBase<T, HookLinks<T, TAG>> {
+public:
+    void init() {
+        this->reset();
     }
 
-    struct LinkedNode<T> *next(struct LinkedNode<T> *node) const {
-        return node->next;
+    // forgets the elements, they stay valid.
+    void exit() {
+        this->reset();
     }
 
-    struct LinkedNode<T> *head() const {
-        return m_head;
+    void put_head(T *elem) {
+        this->link_head(elem);
     }
 
-    struct LinkedNode<T> *tail() const {
-        return m_tail;
+    void put_tail(T *elem) {
+        this->link_tail(elem);
     }
 
-    bool empty() const {
-        return m_size == 0;
+    // elem must be in this list.
+    void unlink(T *elem) {
+        this->unlink_node(elem);
     }
 
-    uint32_t size() const {
-        return m_size;
+    T *pop_head() {
+        auto elem = this->m_head;
+        if (elem) this->unlink_node(elem);
+        return elem;
+    }
+
+    T *pop_tail() {
+        auto elem = this->m_tail;
+        if (elem) this->unlink_node(elem);
+        return elem;
+    }
+
+    void splice(IntrusiveList &other) {
+        this->splice_tail(other);
+    }
+};
+
+// node allocation policies for LinkedList.
+class HeapNodeAlloc {
+public:
+    void *alloc(size_t size) {
+        return ::operator new(size);
+    }
+
+    void free(void *node, size_t) {
+        ::operator delete(node);
+    }
+
+    void merge(HeapNodeAlloc &) {}
+
+    void exit() {}
+};
+
+// Carves nodes out of blocks of CHUNK and recycles freed ones, so a list
+// in steady state never calls the allocator. Blocks go back on exit.
+template <uint32_t CHUNK = 64>
+class PoolNodeAlloc {
+public:
+    void *alloc(size_t size) {
+        if (!m_free) grow(size);
+        auto item = m_free;
+        m_free = item->next;
+        if (!m_free) m_free_tail = nullptr;
+        return item;
+    }
+
+    void free(void *node, size_t) {
+        auto item = (item_t*) node;
+        item->next = m_free;
+        if (!m_free) m_free_tail = item;
+        m_free = item;
+    }
+
+    // takes over other's blocks, so nodes spliced in from it can be freed here.
+    void merge(PoolNodeAlloc &other) {
+        if (&other == this) return;
+        if (other.m_chunks) {
+            other.m_chunks_tail->next = m_chunks;
+            if (!m_chunks) m_chunks_tail = other.m_chunks_tail;
+            m_chunks = other.m_chunks;
+        }
+        if (other.m_free) {
+            other.m_free_tail->next = m_free;
+            if (!m_free) m_free_tail = other.m_free_tail;
+            m_free = other.m_free;
+        }
+        other.m_chunks = other.m_chunks_tail = nullptr;
+        other.m_free = other.m_free_tail = nullptr;
+    }
+
+    void exit() {
+        while (m_chunks) {
+            auto chunk = m_chunks;
+            m_chunks = chunk->next;
+            ::operator delete(chunk);
+        }
+        m_chunks_tail = nullptr;
+        m_free = m_free_tail = nullptr;
     }
 
 private:
-    uint32_t m_size;
-    struct LinkedNode<T> *m_head;
-    struct LinkedNode<T> *m_tail;
+    enum { ALIGN = alignof(std::max_align_t) };
+
+    struct item_t {
+        item_t *next;
+    };
+
+    struct chunk_t {
+        chunk_t *next;
+    };
+
+    void grow(size_t size) {
+        if (size < sizeof(item_t)) size = sizeof(item_t);
+        size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+        auto head = (sizeof(chunk_t) + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+        auto chunk = (chunk_t*) ::operator new(head + size * CHUNK);
+        chunk->next = m_chunks;
+        if (!m_chunks) m_chunks_tail = chunk;
+        m_chunks = chunk;
+        auto base = (char*) chunk + head;
+        for (uint32_t idx = CHUNK; idx > 0; --idx) {
+            free(base + (idx - 1) * size, size);
+        }
+    }
+
+    item_t *m_free = nullptr;
+    item_t *m_free_tail = nullptr;
+    chunk_t *m_chunks = nullptr;
+    chunk_t *m_chunks_tail = nullptr;
+};
+
+// Owning list of T in LinkedNode<T>, nodes come from ALLOC.
+template <typename T, typename ALLOC = HeapNodeAlloc>
+class LinkedList : public ListBase<LinkedNode<T>, NodeLinks<LinkedNode<T>>> {
+public:
+    typedef LinkedNode<T> node_t;
+
+    LinkedList() = default;
+    LinkedList(const LinkedList &) = delete;
+    LinkedList &operator=(const LinkedList &) = delete;
+
+    void init() {
+        this->reset();
+    }
+
+    void exit() {
+        auto last = this->m_head;
+        while (last) {
+            auto node = last->next;
+            destroy(last);
+            last = node;
+        }
+        this->reset();
+        m_alloc.exit();
+    }
+
+    node_t *put_tail(const T &elem) {
+        return emplace_tail(elem);
+    }
+
+    node_t *put_head(const T &elem) {
+        return emplace_head(elem);
+    }
+
+    template <typename... ARGS>
+    node_t *emplace_tail(ARGS&&... args) {
+        auto node = create(std::forward<ARGS>(args)...);
+        this->link_tail(node);
+        return node;
+    }
+
+    template <typename... ARGS>
+    node_t *emplace_head(ARGS&&... args) {
+        auto node = create(std::forward<ARGS>(args)...);
+        this->link_head(node);
+        return node;
+    }
+
+    void del_head() {
+        if (this->m_head) del(this->m_head);
+    }
+
+    void del_tail() {
+        if (this->m_tail) del(this->m_tail);
+    }
+
+    // node must be in this list.
+    void del(node_t *node) {
+        this->unlink_node(node);
+        destroy(node);
+    }
+
+    // takes node out without destroying it. It still belongs to this list's
+    // ALLOC: put it back with relink_head/relink_tail or free it with drop.
+    node_t *unlink(node_t *node) {
+        this->unlink_node(node);
+        return node;
+    }
+
+    void relink_head(node_t *node) {
+        this->link_head(node);
+    }
+
+    void relink_tail(node_t *node) {
+        this->link_tail(node);
+    }
+
+    // node must have come out of this list through unlink.
+    void drop(node_t *node) {
+        destroy(node);
+    }
+
+    // other's nodes after ours, other is left empty. With a pool ALLOC the
+    // pool's blocks move along with them.
+    void splice(LinkedList &other) {
+        m_alloc.merge(other.m_alloc);
+        this->splice_tail(other);
+    }
+
+private:
+    template <typename... ARGS>
+    node_t *create(ARGS&&... args) {
+        auto mem = m_alloc.alloc(sizeof(node_t));
+        try {
+            return new (mem) node_t(std::forward<ARGS>(args)...);
+        } catch (...) {
+            m_alloc.free(mem, sizeof(node_t));
+            throw;
+        }
+    }
+
+    void destroy(node_t *node) {
+        node->~node_t();
+        m_alloc.free(node, sizeof(node_t));
+    }
+
+    ALLOC m_alloc;
 };
 
 #endif //UTILS_LINKEDLIST_H
@@ -6,61 +6,300 @@
 #include <cstdint>
 #include <cassert>
 
+#include <sys/uio.h>
+
+typedef struct buffer_chunk_s {
+    struct buffer_chunk_s *next;
+    uint32_t cap;
+    uint32_t rd;
+    uint32_t wr;
+    uint32_t pad;
+
+    uint8_t *data() {
+        return (uint8_t*) (this + 1);
+    }
+} buffer_chunk_t;
+
+struct BufferSpan {
+    uint8_t *data;
+    uint32_t size;
+};
+
+// Per-thread free list of fixed size chunks. A chunk freed on another
+// thread simply joins that thread's list. Oversized chunks (pullup of a
+// large frame) bypass the pool.
+class BufferPool {
+public:
+    static constexpr uint32_t CHUNK_SIZE = 16384u - sizeof(buffer_chunk_t);
+    static constexpr uint32_t MAX_CACHED = 1024u;
+
+    static buffer_chunk_t *alloc(uint32_t cap=CHUNK_SIZE) {
+        buffer_chunk_t *chunk;
+        auto &cache = local();
+        if (cap <= CHUNK_SIZE && cache.head) {
+            chunk = cache.head;
+            cache.head = chunk->next;
+            --cache.size;
+        } else {
+            if (cap < CHUNK_SIZE) cap = CHUNK_SIZE;
+            chunk = (buffer_chunk_t*) malloc(sizeof(buffer_chunk_t) + cap);
+            chunk->cap = cap;
+        }
+        chunk->next = nullptr;
+        chunk->rd = chunk->wr = 0;
+        return chunk;
+    }
+
+    static void free(buffer_chunk_t *chunk) {
+        auto &cache = local();
+        if (chunk->cap != CHUNK_SIZE || cache.size >= MAX_CACHED) {
+            ::free(chunk);
+            return;
+        }
+        chunk->next = cache.head;
+        cache.head = chunk;
+        ++cache.size;
+    }
+
+private:
+    struct cache_t {
+        buffer_chunk_t *head = nullptr;
+        uint32_t size = 0;
+
+        ~cache_t() {
+            while (head) {
+                auto next = head->next;
+                ::free(head);
+                head = next;
+            }
+        }
+    };
+
+    static cache_t &local() {
+        static thread_local cache_t cache;
+        return cache;
+    }
+};
+
+// Chain of pooled chunks holding at most `limit` bytes, memory is only
+// taken as data arrives. Readers either copy out (peek/get) or work in
+// place through readable_span/readable_iov + consume, writers through
+// writable_span/writable_iov + commit.
 class Buffer {
 public:
-    explicit Buffer(uint16_t size) :
-        m_size(size),
-        m_get_idx(0), m_put_idx(0),
-        m_buf((uint8_t*) malloc(size)) {}
+    explicit Buffer(uint32_t limit) : m_limit(limit) {}
+
+    Buffer(const Buffer&) = delete;
+    Buffer &operator=(const Buffer&) = delete;
 
     ~Buffer() {
-        free(m_buf);
+        while (m_head) {
+            auto next = m_head->next;
+            BufferPool::free(m_head);
+            m_head = next;
+        }
     }
 
-    uint16_t avail() const {
-        return m_put_idx - m_get_idx;
+    uint32_t avail() const {
+        return m_size;
     }
 
-    uint16_t remain() const {
-        return (uint16_t) (m_size - m_put_idx);
+    uint32_t remain() const {
+        return m_limit - m_size;
     }
 
+    // returns spare chunks to the pool and compacts a lone chunk.
     void shrink() {
-        if (m_get_idx == m_put_idx) {
-            m_get_idx = m_put_idx = 0;
-        } else {
-            auto ava = avail();
-            memmove(m_buf, m_buf + m_get_idx, ava);
-            m_get_idx = 0;
-            m_put_idx = ava;
+        if (!m_wr) return;
+        while (m_wr->next) {
+            auto next = m_wr->next->next;
+            BufferPool::free(m_wr->next);
+            m_wr->next = next;
+        }
+        m_tail = m_wr;
+        if (m_head == m_wr && m_head->rd > 0) {
+            auto ava = m_head->wr - m_head->rd;
+            memmove(m_head->data(), m_head->data() + m_head->rd, ava);
+            m_head->rd = 0;
+            m_head->wr = ava;
         }
     }
 
     // must call avail before peek, get, put.
-    void peek(void *buf, uint16_t size) const {
-        memcpy(buf, m_buf + m_get_idx, size);
+    void peek(void *buf, uint32_t size, uint32_t offset=0) const {
+        assert(avail() >= offset + size);
+        auto dst = (uint8_t*) buf;
+        for (auto chunk = m_head; size > 0; chunk = chunk->next) {
+            auto len = chunk->wr - chunk->rd;
+            if (offset >= len) {
+                offset -= len;
+                continue;
+            }
+            len -= offset;
+            if (len > size) len = size;
+            memcpy(dst, chunk->data() + chunk->rd + offset, len);
+            offset = 0;
+            dst += len;
+            size -= len;
+        }
     }
 
-    void get(uint8_t *buf, uint16_t size) {
-        assert(avail() >= size);
-        memmove(buf, m_buf + m_get_idx, size);
-        m_get_idx += size;
-        if (m_get_idx == m_put_idx) {
-            m_get_idx = m_put_idx = 0;
+    void get(uint8_t *buf, uint32_t size) {
+        peek(buf, size);
+        consume(size);
+    }
+
+    void put(const void *buf, uint32_t size) {
+        assert(remain() >= size);
+        auto src = (const uint8_t*) buf;
+        while (size > 0) {
+            auto span = writable_span();
+            auto len = span.size < size ? span.size : size;
+            memcpy(span.data, src, len);
+            commit(len);
+            src += len;
+            size -= len;
+        }
+    }
+
+    // contiguous readable bytes at the front, may be less than avail().
+    BufferSpan readable_span() const {
+        if (m_size == 0) return {nullptr, 0};
+        return {m_head->data() + m_head->rd, m_head->wr - m_head->rd};
+    }
+
+    // contiguous free space, allocates a chunk when needed. Empty only
+    // when remain() is 0.
+    BufferSpan writable_span() {
+        if (remain() == 0) return {nullptr, 0};
+        if (!m_wr) {
+            m_head = m_tail = m_wr = BufferPool::alloc();
+        } else if (m_wr->wr == m_wr->cap) {
+            if (!m_wr->next) {
+                m_tail = m_tail->next = BufferPool::alloc();
+            }
+            m_wr = m_wr->next;
         }
+        auto size = m_wr->cap - m_wr->wr;
+        return {m_wr->data() + m_wr->wr, size < remain() ? size : remain()};
     }
 
-    void put(uint8_t *buf, uint16_t size) {
+    // marks size bytes written through writable_span/writable_iov.
+    void commit(uint32_t size) {
         assert(remain() >= size);
-        memcpy(m_buf + m_put_idx, buf, size);
-        m_put_idx += size;
+        if (size == 0) return;
+        m_size += size;
+        for (;;) {
+            auto len = m_wr->cap - m_wr->wr;
+            if (len > size) len = size;
+            m_wr->wr += len;
+            size -= len;
+            if (size == 0) break;
+            m_wr = m_wr->next;
+        }
+    }
+
+    void consume(uint32_t size) {
+        assert(avail() >= size);
+        m_size -= size;
+        m_scanned = m_scanned > size ? m_scanned - size : 0;
+        while (size > 0 || (m_head != m_wr && m_head->rd == m_head->wr)) {
+            auto len = m_head->wr - m_head->rd;
+            if (len > size) len = size;
+            m_head->rd += len;
+            size -= len;
+            if (m_head->rd != m_head->wr) break;
+            if (m_head == m_wr) {
+                m_head->rd = m_head->wr = 0;
+                break;
+            }
+            auto next = m_head->next;
+            BufferPool::free(m_head);
+            m_head = next;
+        }
+    }
+
+    // how far a reader has searched the readable bytes for a frame end, so
+    // a partial frame is not rescanned on every read. consume() keeps it
+    // relative to the read position.
+    uint32_t scanned() const {
+        return m_scanned;
+    }
+
+    void set_scanned(uint32_t offset) {
+        m_scanned = offset;
+    }
+
+    // fills up to cnt iovecs covering readable bytes [offset, offset + len),
+    // returns the number used.
+    int readable_iov(struct iovec *iov, int cnt, uint32_t offset=0, uint32_t len=UINT32_MAX) const {
+        if (offset >= m_size) return 0;
+        if (len > m_size - offset) len = m_size - offset;
+        int num = 0;
+        for (auto chunk = m_head; chunk && len > 0 && num < cnt; chunk = chunk->next) {
+            auto size = chunk->wr - chunk->rd;
+            if (offset >= size) {
+                offset -= size;
+                continue;
+            }
+            size -= offset;
+            if (size > len) size = len;
+            iov[num].iov_base = chunk->data() + chunk->rd + offset;
+            iov[num].iov_len = size;
+            ++num;
+            len -= size;
+            offset = 0;
+        }
+        return num;
+    }
+
+    // reserves chunks for up to size more bytes (capped by remain()) and
+    // describes them for readv/recvmsg, follow with commit(bytes read).
+    int writable_iov(struct iovec *iov, int cnt, uint32_t size) {
+        if (size > remain()) size = remain();
+        if (size == 0 || cnt == 0) return 0;
+        auto span = writable_span();
+        iov[0].iov_base = span.data;
+        iov[0].iov_len = span.size < size ? span.size : size;
+        size -= (uint32_t) iov[0].iov_len;
+        int num = 1;
+        for (auto chunk = m_wr; size > 0 && num < cnt; ++num) {
+            if (!chunk->next) {
+                m_tail = m_tail->next = BufferPool::alloc();
+            }
+            chunk = chunk->next;
+            iov[num].iov_base = chunk->data();
+            iov[num].iov_len = chunk->cap < size ? chunk->cap : size;
+            size -= (uint32_t) iov[num].iov_len;
+        }
+        return num;
+    }
+
+    // makes the first size bytes contiguous, for parsers that need a whole
+    // frame in one piece. Only copies when they straddle chunks.
+    uint8_t *pullup(uint32_t size) {
+        assert(avail() >= size);
+        if (size == 0) return nullptr;
+        if (m_head->wr - m_head->rd >= size) {
+            return m_head->data() + m_head->rd;
+        }
+        auto chunk = BufferPool::alloc(size);
+        peek(chunk->data(), size);
+        chunk->wr = size;
+        consume(size);
+        m_size += size;
+        chunk->next = m_head;
+        m_head = chunk;
+        return chunk->data();
     }
 
 private:
-    uint8_t *m_buf;
-    uint16_t m_size;
-    uint16_t m_get_idx;
-    uint16_t m_put_idx;
+    uint32_t m_limit;
+    uint32_t m_size = 0;
+    uint32_t m_scanned = 0;
+    buffer_chunk_t *m_head = nullptr;    // oldest unread data
+    buffer_chunk_t *m_wr = nullptr;      // chunk being written, later ones are spare
+    buffer_chunk_t *m_tail = nullptr;
 };
 
 #endif //UTILS_BUFFER_H
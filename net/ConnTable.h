@@ -0,0 +1,95 @@
+//
+// Dense fd-indexed connection table.
+//
+
+#ifndef UTILS_CONNTABLE_H
+#define UTILS_CONNTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Slots are indexed directly by fd (the kernel hands out the lowest free fd,
+// so the table stays dense) and padded to a cache line. Each open bumps the
+// slot generation, conn_id() packs it with the fd so a stale id held by the
+// application never resolves to a newer connection reusing the same fd.
+template <typename INFO>
+class ConnTable {
+public:
+    struct alignas(64) slot_t {
+        INFO info;
+        uint32_t gen;
+        int32_t live_idx;   // position in m_live, -1 when closed
+    };
+
+    INFO *open(int fd) {
+        if (fd < 0) return nullptr;
+        if ((size_t) fd >= m_slots.size()) {
+            auto size = m_slots.size() * 2;
+            if (size < (size_t) fd + 1) size = fd + 1;
+            m_slots.resize(size, slot_t{INFO{}, 0, -1});
+        }
+        auto slot = &m_slots[fd];
+        slot->info = INFO{};
+        ++slot->gen;
+        slot->live_idx = (int32_t) m_live.size();
+        m_live.push_back(fd);
+        return &slot->info;
+    }
+
+    void close(int fd) {
+        auto slot = &m_slots[fd];
+        auto idx = slot->live_idx;
+        auto last = m_live.back();
+        m_live[idx] = last;
+        m_slots[last].live_idx = idx;
+        m_live.pop_back();
+        slot->live_idx = -1;
+    }
+
+    INFO *get(int fd) {
+        if (fd < 0 || (size_t) fd >= m_slots.size() || m_slots[fd].live_idx < 0) {
+            return nullptr;
+        }
+        return &m_slots[fd].info;
+    }
+
+    // 0, which never resolves, for an fd the table has not seen.
+    uint64_t conn_id(int fd) const {
+        if (fd < 0 || (size_t) fd >= m_slots.size()) return 0;
+        return ((uint64_t) m_slots[fd].gen << 32) | (uint32_t) fd;
+    }
+
+    // -1 if the connection behind conn_id has been closed since.
+    int conn_fd(uint64_t conn_id) const {
+        auto fd = (int) (uint32_t) conn_id;
+        if ((size_t) fd >= m_slots.size()) return -1;
+        auto &slot = m_slots[fd];
+        if (slot.live_idx < 0 || slot.gen != (uint32_t) (conn_id >> 32)) return -1;
+        return fd;
+    }
+
+    // conn ids of the live connections, for walks whose callbacks may
+    // close or open connections; resolve each with conn_fd before use.
+    void snapshot(std::vector<uint64_t> *ids) const {
+        ids->clear();
+        ids->reserve(m_live.size());
+        for (auto fd : m_live) {
+            ids->push_back(conn_id(fd));
+        }
+    }
+
+    const std::vector<int> &live() const {
+        return m_live;
+    }
+
+    bool empty() const {
+        return m_live.empty();
+    }
+
+private:
+    std::vector<slot_t> m_slots{};
+    std::vector<int> m_live{};
+};
+
+#endif //UTILS_CONNTABLE_H
@@ -6,33 +6,131 @@
 #define UTILS_EVENTLOOP_H
 
 #include "Buffer.h"
+#include "ConnTable.h"
+#include "OutputQueue.h"
+#include "TopicTable.h"
 #include "TcpServer.h"
 #include "Timer.h"
 
-#include <map>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <climits>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
 #include <functional>
 
 #include <unistd.h>
 #include "log_std.h"
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 enum {
     EPOLL_STATUS_READING,
     EPOLL_STATUS_WRITING
 };
 
+enum {
+    EPOLL_WAIT_BUSY_POLL,   // never sleep, lowest latency, burns the core
+    EPOLL_WAIT_TIMEOUT,     // sleep at most wait_ms or until the next timer
+    EPOLL_WAIT_TIMER        // sleep until io, the next timer or stop()
+};
+
 class EventLoop {
 public:
-    bool init(uint16_t port, int epsz) {
+    // reuseport must be set when several loops listen on the same port
+    // (see EventLoopGroup), each loop then owns its own listener.
+    bool init(uint16_t port, int epsz, bool reuseport=false) {
         m_epee = (struct epoll_event*) calloc(
                 epsz + 1, sizeof(struct epoll_event));
+        if (!m_epee) return false;
         m_epsz = epsz;
-        m_ts.init(port, true);
+        if (!m_ts.init(port, true, reuseport)) {
+            SYS("listen port[%u] errno[%d]", port, errno);
+            exit();
+            return false;
+        }
+        m_svr_fd = m_ts.get_sock_fd();
 
+        // exit() undoes whatever part got done
         m_epfd = epoll_create(1024);
-        if (-1 == m_epfd) return false;
-        m_svr_fd = m_ts.get_sock_fd();
-        return add_event(m_svr_fd);
+        m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (-1 == m_epfd || -1 == m_wake_fd || !add_event(m_wake_fd, m_wake_fd) ||
+            !add_event(m_svr_fd, m_svr_fd)) {
+            exit();
+            return false;
+        }
+        m_now_ms = Timer::now_ms();
+        m_timer.init(m_now_ms);
+        return true;
+    }
+
+    // corked: send_data only queues, every connection written to during
+    // an iteration is flushed once at its end with one writev.
+    void set_cork(bool on) {
+        m_cork = on;
+    }
+
+    // payloads of at least threshold bytes passed to send_data(fd, payload)
+    // are sent with MSG_ZEROCOPY, 0 disables. Applies to connections
+    // accepted afterwards.
+    void set_zerocopy(uint32_t threshold) {
+        m_zc_threshold = threshold;
+    }
+
+    // Queued output reaching high calls on_write_blocked, falling back to
+    // low afterwards calls on_write_drained. pause_read also stops reading
+    // from the fd in between, so a slow consumer cannot keep feeding
+    // requests. high 0 disables; set_max_buffer stays the hard cap.
+    void set_write_watermark(uint32_t high, uint32_t low, bool pause_read=false) {
+        m_high_mark = high;
+        m_low_mark = low;
+        m_pause_read = pause_read;
+    }
+
+    void on_write_blocked(std::function<void(int)> &&blocked_func) {
+        m_blocked_func = blocked_func;
+    }
+
+    void on_write_drained(std::function<void(int)> &&drained_func) {
+        m_drained_func = drained_func;
+    }
+
+    // queued output bytes, for producers that throttle on their own.
+    uint32_t pending_bytes(int fd) {
+        auto info = m_info_tbl.get(fd);
+        return info ? info->wque->avail() : 0;
+    }
+
+    // per-direction cap on buffered bytes of one connection, memory is
+    // only taken as data arrives. Applies to connections accepted afterwards.
+    void set_max_buffer(uint32_t size) {
+        m_max_buf_size = size;
+    }
+
+    // EPOLLET for every fd, must be set before init. Readiness is then
+    // drained until EAGAIN and on_message fires once per drain.
+    void set_edge_triggered(bool on) {
+        m_edge_trigger = on;
+    }
+
+    // EPOLL_WAIT_BUSY_POLL is the default, wait_ms only applies to EPOLL_WAIT_TIMEOUT.
+    void set_wait_mode(int mode, int wait_ms=0) {
+        m_wait_mode = mode;
+        m_wait_ms = wait_ms;
+    }
+
+    // connections without inbound data for idle_ms are closed, 0 disables.
+    // Only applies to connections accepted afterwards.
+    void set_idle_timeout(uint32_t idle_ms) {
+        m_idle_ms = idle_ms;
     }
 
     void on_connect(std::function<void(int)> &&init_func) {
@@ -47,16 +145,45 @@ public:
         m_exit_func = exit_func;
     }
 
+    // runs loop() until stop() is called, possibly from another thread.
+    void run() {
+        while (!m_is_stop.load(std::memory_order_relaxed)) {
+            loop();
+        }
+    }
+
+    void stop() {
+        m_is_stop.store(true, std::memory_order_relaxed);
+        uint64_t one = 1;
+        (void) ::write(m_wake_fd, &one, sizeof(one));
+    }
+
     void loop() {
-        constexpr uint16_t max_read_buf_size = 512u;
-        uint8_t tmp_buf[max_read_buf_size];
-        auto rdy_num = epoll_wait(m_epfd, m_epee, m_epsz, 0);
-        if (-1 == rdy_num) {
-            SYS("epoll_wait return errno[%d]", errno);
+        // output queued between two loop() calls must not wait for epoll_wait
+        flush_dirty();
+        auto rdy_num = epoll_wait(m_epfd, m_epee, m_epsz, wait_timeout());
+        if (-1 == rdy_num && errno != EINTR) {
+            SYS_RATE_LIMITED(1000, "epoll_wait return errno[%d]", errno);
         }
+        m_now_ms = Timer::now_ms();
         for (auto idx = 0; idx < rdy_num; ++idx) {
-            auto fd = m_epee[idx].data.fd;
+            // connections are registered by conn_id, the listener and the
+            // wake fd by their bare fd (generation 0)
+            auto id = m_epee[idx].data.u64;
+            auto fd = (int) (uint32_t) id;
             auto evt = m_epee[idx].events;
+            if (fd == m_wake_fd) {
+                uint64_t cnt;
+                (void) ::read(m_wake_fd, &cnt, sizeof(cnt));
+                continue;
+            }
+            // closed by an earlier event of this batch, its fd maybe reused since
+            if (fd != m_svr_fd && m_info_tbl.conn_fd(id) == -1) {
+                continue;
+            }
+            if ((evt & EPOLLERR) && m_zc_threshold > 0 && recv_errqueue(fd) && !(evt & EPOLLHUP)) {
+                evt &= ~EPOLLERR;
+            }
             if ((evt & (EPOLLERR | EPOLLHUP)) && !(evt & EPOLLIN)) {
                 SYS("epoll_wait event error fd[%d] evt[%d] errno[%d]", fd, evt, errno);
                 on_close(fd);
@@ -70,130 +197,308 @@ public:
                     continue;
                 }
                 // Data
-                auto n = recv(fd, tmp_buf, max_read_buf_size, MSG_DONTWAIT);
-                if (n == 0) {
-                    on_close(fd);
-                    continue;
-                } else if (n < 0) {
-                    if (errno == EAGAIN) {
-                        SYS("recv empty message error[%d]", errno);
-                        continue;
-                    }
-                    on_close(fd);
-                    continue;
-                } else {
-                    recv_epollin(fd, tmp_buf, n);
-                }
+                recv_epollin(fd);
             }
             // EPOLLOUT
             if (evt & EPOLLOUT) {
                 send_epollout(fd);
             }
         }
+        m_timer.advance(m_now_ms);
+        flush_dirty();
+        if (!m_linger.empty()) reap_linger();
     }
 
+    // timers fire on the loop thread, interval_ms 0 means one-shot.
+    uint64_t run_after(uint32_t delay_ms, std::function<void()> &&func) {
+        return m_timer.add(Timer::now_ms(), delay_ms, 0, std::move(func));
+    }
+
+    uint64_t run_every(uint32_t interval_ms, std::function<void()> &&func) {
+        return m_timer.add(Timer::now_ms(), interval_ms, interval_ms, std::move(func));
+    }
+
+    void cancel_timer(uint64_t timer_id) {
+        m_timer.cancel(timer_id);
+    }
+
+    // copies buf, dropped silently if the connection is gone by then.
+    uint64_t send_later(uint64_t conn_id, uint32_t delay_ms, const void *buf, uint32_t size) {
+        std::string data((const char*) buf, size);
+        return m_timer.add(Timer::now_ms(), delay_ms, 0, [this, conn_id, data] {
+            auto fd = m_info_tbl.conn_fd(conn_id);
+            if (fd != -1) {
+                send_data(fd, data.data(), (uint32_t) data.size());
+            }
+        });
+    }
+
+    // over the connections live at the call, func may close or open any;
+    // ones closed before their turn are skipped.
     void broadcast(std::function<void(int)> &&func) {
-        for (auto &&e : m_info_map) {
-            func(e.first);
+        std::vector<uint64_t> ids;
+        m_info_tbl.snapshot(&ids);
+        for (auto id : ids) {
+            auto fd = m_info_tbl.conn_fd(id);
+            if (fd >= 0) func(fd);
         }
     }
 
-    bool send_data(int fd, void *buf, uint32_t size) {
-        auto info = &m_info_map[fd];
-        auto wbuf = info->wbuf;
+    // One payload, one reference per connection, nothing is copied per
+    // receiver. Output is flushed at the end of the iteration, one writev
+    // per connection however many payloads were queued in between.
+    void broadcast(SharedPayload *payload) {
+        auto ids = take_fanout();
+        m_info_tbl.snapshot(&ids);
+        fan_out(ids, payload);
+    }
 
-        if (info->stat == EPOLL_STATUS_WRITING) {
-            if (wbuf->remain() < size) {
-                SYS("send overflow fd[%d]", fd);
-                on_close(fd);
-                return false;
-            } else {
-                wbuf->put((uint8_t*) buf, size);
-                return true;
-            }
-        } else if (info->stat == EPOLL_STATUS_READING) {
-            auto ret = ::send(fd, buf, size, MSG_DONTWAIT);
+    // topics let publish reach only their subscribers, subscriptions are
+    // dropped when the connection closes.
+    bool subscribe(int fd, uint32_t topic) {
+        return m_info_tbl.get(fd) && m_topics.subscribe(fd, topic);
+    }
+
+    bool unsubscribe(int fd, uint32_t topic) {
+        return m_info_tbl.get(fd) && m_topics.unsubscribe(fd, topic);
+    }
+
+    void publish(uint32_t topic, SharedPayload *payload) {
+        auto fds = m_topics.members(topic);
+        if (!fds) return;
+        auto ids = take_fanout();
+        for (auto fd : *fds) {
+            ids.push_back(m_info_tbl.conn_id(fd));
+        }
+        fan_out(ids, payload);
+    }
+
+    // conn_id stays unique across fd reuse, conn_fd returns -1 once the
+    // connection it names has been closed.
+    uint64_t conn_id(int fd) const {
+        return m_info_tbl.conn_id(fd);
+    }
+
+    int conn_fd(uint64_t conn_id) const {
+        return m_info_tbl.conn_fd(conn_id);
+    }
+
+    // Tries the socket directly when nothing is queued and the loop is not
+    // corked, whatever is left is queued (copied) and flushed later.
+    bool send_data(int fd, const void *buf, uint32_t size) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) {
+            SYS("send to closed fd[%d]", fd);
+            return false;
+        }
+        auto wque = info->wque;
+
+        if (!m_cork && wque->empty()) {
+            auto ret = ::send(fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (ret == size) return true;
             if (ret == -1) {
-                if (errno == EAGAIN) {
-                    if (wbuf->remain() < size) {
-                        SYS("no avail resource for fd[%d]", fd);
-                        on_close(fd);
-                        return false;
-                    } else {
-                        wbuf->put((uint8_t*) buf, size);
-                        if (r2w_event(fd)) {
-                            info->stat = EPOLL_STATUS_WRITING;
-                            return true;
-                        } else {
-                            on_close(fd);
-                            return false;
-                        }
-                    }
-                } else {
-                    if (errno != ECONNRESET) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    if (errno != ECONNRESET && errno != EPIPE) {
                         SYS("fd[%d] send occur error", fd);
                     }
                     on_close(fd);
                     return false;
                 }
-            } else if (ret == size) {
-                return true;
-            } else if (ret != size) {
-                wbuf->put((uint8_t*)buf + ret, size - ret);
-                return true;
-            } else {
-                SYS("known errno[%d]", errno);
-                return false;
+                ret = 0;
             }
-        } else {
-            SYS("status[%d] error", info->stat);
+            buf = (const uint8_t*) buf + ret;
+            size -= (uint32_t) ret;
+        }
+        if (!wque->put(buf, size)) {
+            SYS_RATE_LIMITED(1000, "send overflow fd[%d]", fd);
+            on_close(fd);
+            return false;
+        }
+        if (!check_high_mark(fd, info)) return false;
+        // uncorked, the socket just took less than offered
+        return m_cork ? want_flush(fd, info) : arm_write(fd, info);
+    }
+
+    // Queues a reference instead of a copy, payload can be released by the
+    // caller right after. Large payloads go out with MSG_ZEROCOPY when
+    // enabled with set_zerocopy.
+    bool send_data(int fd, SharedPayload *payload) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) {
+            SYS("send to closed fd[%d]", fd);
+            return false;
+        }
+        if (!info->wque->put(payload)) {
+            SYS_RATE_LIMITED(1000, "send overflow fd[%d]", fd);
+            on_close(fd);
             return false;
         }
+        if (!check_high_mark(fd, info)) return false;
+        return want_flush(fd, info);
     }
 
     void force_close_connection(int fd) {
         on_close(fd);
     }
 
+    // waits up to zc_linger_ms for outstanding zero copy completions.
+    void exit() {
+        while (!m_info_tbl.empty()) {
+            on_close(m_info_tbl.live().back());
+        }
+        while (!m_linger.empty()) {
+            reap_linger();
+            if (m_linger.empty()) break;
+            usleep(linger_poll_ms * 1000);
+            m_now_ms = Timer::now_ms();
+        }
+        if (m_epfd != -1) {
+            close(m_epfd);
+            m_epfd = -1;
+        }
+        if (m_svr_fd != -1) {
+            close(m_svr_fd);
+            m_svr_fd = -1;
+        }
+        if (m_wake_fd != -1) {
+            close(m_wake_fd);
+            m_wake_fd = -1;
+        }
+        free(m_epee);
+        m_epee = nullptr;
+    }
+
 private:
+    typedef struct {
+        Buffer *rbuf;
+        OutputQueue *wque;
+        int stat;
+        bool dirty;
+        bool zerocopy;
+        bool blocked;       // above the high watermark
+        bool paused;        // EPOLLIN dropped while blocked
+        uint64_t last_active;
+        uint64_t idle_timer;
+    } event_loop_info_t;
+
+    typedef struct {
+        int fd;
+        OutputQueue *wque;
+        uint64_t deadline;
+    } linger_t;
+
     void init_info(int fd) {
-        const auto max_buf_size = 65535u;
-        event_loop_info_t info{};
-        info.rbuf = new Buffer(max_buf_size);
-        info.wbuf = new Buffer(max_buf_size);
-        info.stat = EPOLL_STATUS_READING;
-        m_info_map[fd] = info;
+        auto info = m_info_tbl.open(fd);
+        info->rbuf = new Buffer(m_max_buf_size);
+        info->wque = new OutputQueue(m_max_buf_size);
+        if (m_zc_threshold > 0) {
+            const int on = 1;
+            info->zerocopy = 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+        }
+        info->stat = EPOLL_STATUS_READING;
+        info->last_active = m_now_ms;
+        if (m_idle_ms > 0) {
+            info->idle_timer = m_timer.add(m_now_ms, m_idle_ms, 0, [this, fd] { check_idle(fd); });
+        }
+    }
+
+    void check_idle(int fd) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return;
+        auto idle = m_now_ms - info->last_active;
+        if (idle >= m_idle_ms) {
+            info->idle_timer = 0;
+            on_close(fd);
+        } else {
+            info->idle_timer = m_timer.add(m_now_ms, m_idle_ms - idle, 0, [this, fd] { check_idle(fd); });
+        }
+    }
+
+    int wait_timeout() const {
+        if (m_wait_mode == EPOLL_WAIT_BUSY_POLL) return 0;
+        auto next = m_timer.next_timeout(m_now_ms);
+        // lingering fds are off epoll, poll their error queues
+        if (!m_linger.empty() && (next < 0 || next > linger_poll_ms)) next = linger_poll_ms;
+        if (m_wait_mode == EPOLL_WAIT_TIMEOUT && (next < 0 || next > m_wait_ms)) {
+            return m_wait_ms;
+        }
+        return next > INT_MAX ? INT_MAX : (int) next;
     }
 
     void exit_info(int fd) {
-        delete m_info_map[fd].rbuf;
-        delete m_info_map[fd].wbuf;
-        m_info_map.erase(fd);
+        auto info = m_info_tbl.get(fd);
+        m_timer.cancel(info->idle_timer);
+        m_topics.remove(fd);
+        delete info->rbuf;
+        delete info->wque;      // nullptr when on_close keeps it
+        m_info_tbl.close(fd);
     }
 
     void on_accept() {
-        auto clt_fd = m_ts.accept();
-        if (clt_fd != -1) {
-            if (add_event(clt_fd)) {
+        do {
+            auto clt_fd = m_ts.accept();
+            if (clt_fd != -1) {
                 init_info(clt_fd);
-                m_init_func(clt_fd);
+                if (add_event(clt_fd, m_info_tbl.conn_id(clt_fd))) {
+                    m_init_func(clt_fd);
+                } else {
+                    exit_info(clt_fd);
+                    close(clt_fd);
+                }
+            } else {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    SYS_RATE_LIMITED(1000, "accept errno[%d]", errno);
+                }
+                return;
             }
-        } else {
-            SYS("accept errno[%d]", errno);
-        }
+        } while (m_edge_trigger);
     }
 
     void on_close(int fd) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return;
         m_exit_func(fd);
         (void) del_event(fd);
+        auto wque = info->wque;
+        info->wque = nullptr;
         exit_info(fd);
-        close(fd);
+        if (wque->zerocopy_pending()) {
+            linger(fd, wque);
+        } else {
+            delete wque;
+            close(fd);
+        }
     }
 
-    bool add_event(int fd) const {
+    // The kernel may still read the pages of zero copy sends when the
+    // connection closes. The fd is shut down but kept open, for its error
+    // queue, and the queue alive until every completion is in or
+    // zc_linger_ms passed.
+    void linger(int fd, OutputQueue *wque) {
+        shutdown(fd, SHUT_RDWR);
+        m_linger.push_back({fd, wque, m_now_ms + zc_linger_ms});
+    }
+
+    void reap_linger() {
+        for (size_t idx = 0; idx < m_linger.size();) {
+            auto &item = m_linger[idx];
+            drain_errqueue(item.fd, item.wque, nullptr);
+            if (item.wque->zerocopy_pending() && m_now_ms < item.deadline) {
+                ++idx;
+                continue;
+            }
+            delete item.wque;
+            close(item.fd);
+            m_linger[idx] = m_linger.back();
+            m_linger.pop_back();
+        }
+    }
+
+    // id comes back with every event of fd, see loop().
+    bool add_event(int fd, uint64_t id) const {
         struct epoll_event ee{};
-        ee.data.fd = fd;
-        ee.events = EPOLLIN;
+        ee.data.u64 = id;
+        ee.events = EPOLLIN | (m_edge_trigger ? (uint32_t) EPOLLET : 0u);
         auto ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ee);
         if (-1 == ret) {
             SYS("epoll_ctl add error fd[%d] errno[%d]", fd, errno);
@@ -214,47 +519,281 @@ private:
         return true;
     }
 
-    void recv_epollin(int fd, uint8_t *tmp_buf, uint32_t size) {
-        auto buf = m_info_map[fd].rbuf;
-        if (buf->remain() >= size) {
-            buf->put((uint8_t*)tmp_buf, size);
-            m_recv_func(fd, m_info_map[fd].rbuf);
-        } else {
-            SYS("read buf has no enough space fd[%d] errno[%d]", fd, errno);
+    static constexpr int max_read_iov = 4;
+    static constexpr uint32_t zc_linger_ms = 5000;
+    static constexpr int linger_poll_ms = 10;
+    static constexpr int max_write_iov = 64;
+    static constexpr uint32_t max_read_size = 65536u;
+
+    // Reads straight into rbuf. Level-triggered does one recv per event,
+    // edge-triggered recvs until EAGAIN and only hands rbuf to on_message
+    // early when it fills up mid-drain.
+    void recv_epollin(int fd) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return;
+        auto buf = info->rbuf;
+        info->last_active = m_now_ms;
+        uint32_t size = 0;
+        struct iovec iov[max_read_iov];
+        for (;;) {
+            if (buf->remain() == 0) {
+                if (size == 0) {
+                    SYS("read buf has no enough space fd[%d]", fd);
+                    on_close(fd);
+                    return;
+                }
+                if (!deliver(fd, buf)) return;
+                size = 0;
+                continue;
+            }
+            auto cnt = buf->writable_iov(iov, max_read_iov, max_read_size);
+            auto n = readv(fd, iov, cnt);
+            if (n > 0) {
+                buf->commit((uint32_t) n);
+                size += n;
+                if (m_edge_trigger) continue;
+                break;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            // peer closed or failed, hand over what arrived before it did
+            if (size > 0 && !deliver(fd, buf)) return;
             on_close(fd);
+            return;
         }
+        if (size > 0) {
+            deliver(fd, buf);
+        }
+    }
+
+    // false if on_message closed the connection.
+    bool deliver(int fd, Buffer *buf) {
+        auto id = m_info_tbl.conn_id(fd);
+        m_recv_func(fd, buf);
+        return m_info_tbl.conn_fd(id) != -1;
     }
 
     void send_epollout(int fd) {
-        auto info = &m_info_map[fd];
-        auto wbuf = info->wbuf;
-        auto size = wbuf->avail();
-        uint8_t tmp_buf[size];
-        wbuf->get((uint8_t*) tmp_buf, size);
-
-        auto ret = ::send(fd, tmp_buf, size, MSG_DONTWAIT);
-        if (ret == -1) {
-            if (errno == EAGAIN) {
-                wbuf->put((uint8_t*) tmp_buf, size);
+        if (m_info_tbl.get(fd)) {
+            (void) flush(fd);
+        }
+    }
+
+    bool want_flush(int fd, event_loop_info_t *info) {
+        if (info->stat == EPOLL_STATUS_WRITING) return true;
+        if (!m_cork) return flush(fd);
+        defer_flush(fd, info);
+        return true;
+    }
+
+    void defer_flush(int fd, event_loop_info_t *info) {
+        if (!info->dirty && info->stat == EPOLL_STATUS_READING) {
+            info->dirty = true;
+            m_dirty.push_back(fd);
+        }
+    }
+
+    // An overflow closes its connection and on_disconnect may close or
+    // open others, so fan-out walks conn ids taken up front and skips the
+    // ones closed since. The id vector is reused across calls, a nested
+    // broadcast from on_disconnect just starts with an empty one.
+    std::vector<uint64_t> take_fanout() {
+        std::vector<uint64_t> ids;
+        ids.swap(m_fanout);
+        ids.clear();
+        return ids;
+    }
+
+    void fan_out(std::vector<uint64_t> &ids, SharedPayload *payload) {
+        for (auto id : ids) {
+            auto fd = m_info_tbl.conn_fd(id);
+            if (fd >= 0) queue_payload(fd, payload);
+        }
+        if (ids.capacity() > m_fanout.capacity()) {
+            ids.clear();
+            m_fanout.swap(ids);
+        }
+    }
+
+    void queue_payload(int fd, SharedPayload *payload) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return;
+        if (!info->wque->put(payload)) {
+            SYS_RATE_LIMITED(1000, "send overflow fd[%d]", fd);
+            on_close(fd);
+            return;
+        }
+        if (check_high_mark(fd, info)) {
+            defer_flush(fd, info);
+        }
+    }
+
+    // a failed flush closes its connection, and on_disconnect may send to
+    // others, so work on a swapped out list until no more get dirty.
+    void flush_dirty() {
+        while (!m_dirty.empty()) {
+            m_flushing.swap(m_dirty);
+            for (auto fd : m_flushing) {
+                auto info = m_info_tbl.get(fd);
+                if (info && info->dirty) {
+                    info->dirty = false;
+                    if (info->stat == EPOLL_STATUS_READING) {
+                        (void) flush(fd);
+                    }
+                }
+            }
+            m_flushing.clear();
+        }
+    }
+
+    // Writes the queue until it is empty or the socket is full, then
+    // switches EPOLLOUT interest to match. false if the connection closed.
+    bool flush(int fd) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return false;
+        auto wque = info->wque;
+        struct iovec iov[max_write_iov];
+        while (!wque->empty()) {
+            struct msghdr msg{};
+            int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+            auto zc = info->zerocopy && wque->front_zerocopy(m_zc_threshold);
+            if (zc) {
+                msg.msg_iovlen = wque->zerocopy_iov(iov, max_write_iov, m_zc_threshold);
+                flags |= MSG_ZEROCOPY;
             } else {
-                SYS("fd[%d] send occur error (epollout) errno[%d]", fd, errno);
+                msg.msg_iovlen = wque->readable_iov(iov, max_write_iov);
+            }
+            msg.msg_iov = iov;
+            size_t size = 0;
+            for (size_t idx = 0; idx < msg.msg_iovlen; ++idx) {
+                size += iov[idx].iov_len;
+            }
+
+            auto ret = ::sendmsg(fd, &msg, flags);
+            if (ret == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == ENOBUFS && zc) {
+                    // out of optmem for notifications, fall back to copying
+                    info->zerocopy = false;
+                    continue;
+                }
+                if (errno != ECONNRESET && errno != EPIPE) {
+                    SYS("fd[%d] send occur error (flush) errno[%d]", fd, errno);
+                }
                 on_close(fd);
+                return false;
             }
-        } else if (ret != size) {
-            wbuf->put(tmp_buf + ret, size - ret);
-        } else if (ret == size) {
-            if (w2r_event(fd)) {
-                info->stat = EPOLL_STATUS_READING;
+            if (zc) {
+                wque->consume_zerocopy((uint32_t) ret);
             } else {
+                wque->consume((uint32_t) ret);
+            }
+            if ((size_t) ret < size) break;
+        }
+
+        if (info->blocked && wque->avail() <= m_low_mark) {
+            info->blocked = false;
+            if (info->paused) {
+                info->paused = false;
+                auto ok = info->stat == EPOLL_STATUS_WRITING ? r2w_event(fd, info) : w2r_event(fd, info);
+                if (!ok) {
+                    on_close(fd);
+                    return false;
+                }
+            }
+            if (m_drained_func) {
+                auto id = m_info_tbl.conn_id(fd);
+                m_drained_func(fd);
+                if (m_info_tbl.conn_fd(id) == -1) return false;
+            }
+        }
+        if (wque->empty() && info->stat == EPOLL_STATUS_WRITING) {
+            if (!w2r_event(fd, info)) {
+                on_close(fd);
+                return false;
+            }
+            info->stat = EPOLL_STATUS_READING;
+        } else if (!wque->empty()) {
+            return arm_write(fd, info);
+        }
+        return true;
+    }
+
+    // Called after output was queued. Crossing the high watermark reports
+    // the peer as slow and optionally stops reading from it. false if the
+    // connection was closed from the callback.
+    bool check_high_mark(int fd, event_loop_info_t *info) {
+        if (m_high_mark == 0 || info->blocked || info->wque->avail() < m_high_mark) {
+            return true;
+        }
+        info->blocked = true;
+        if (m_pause_read) {
+            info->paused = true;
+            auto ok = info->stat == EPOLL_STATUS_WRITING ? r2w_event(fd, info) : w2r_event(fd, info);
+            if (!ok) {
                 on_close(fd);
+                return false;
+            }
+        }
+        if (m_blocked_func) {
+            auto id = m_info_tbl.conn_id(fd);
+            m_blocked_func(fd);
+            return m_info_tbl.conn_fd(id) != -1;
+        }
+        return true;
+    }
+
+    bool arm_write(int fd, event_loop_info_t *info) {
+        if (info->stat == EPOLL_STATUS_READING) {
+            if (!r2w_event(fd, info)) {
+                on_close(fd);
+                return false;
             }
+            info->stat = EPOLL_STATUS_WRITING;
         }
+        return true;
     }
 
-    bool r2w_event(int fd) const {
+    // Releases payloads whose MSG_ZEROCOPY sends completed, true if any
+    // completion was read (the EPOLLERR was only the notification).
+    bool recv_errqueue(int fd) {
+        auto info = m_info_tbl.get(fd);
+        if (!info) return false;
+        return drain_errqueue(fd, info->wque, &info->zerocopy);
+    }
+
+    bool drain_errqueue(int fd, OutputQueue *wque, bool *zerocopy) {
+        auto got = false;
+        for (;;) {
+            char control[128];
+            struct msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (-1 == recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) break;
+            for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                    continue;
+                }
+                auto serr = (struct sock_extended_err*) CMSG_DATA(cmsg);
+                if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                wque->complete_zerocopy(serr->ee_info, serr->ee_data);
+                if (zerocopy && (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                    // kernel copied anyway (e.g. loopback), stop paying for notifications
+                    *zerocopy = false;
+                }
+                got = true;
+            }
+        }
+        return got;
+    }
+
+    // EPOLLIN is left out while reading is paused by backpressure.
+    bool r2w_event(int fd, const event_loop_info_t *info) const {
         struct epoll_event ee{};
-        ee.data.fd = fd;
-        ee.events = EPOLLIN | EPOLLOUT;
+        ee.data.u64 = m_info_tbl.conn_id(fd);
+        ee.events = (info->paused ? 0u : EPOLLIN) | EPOLLOUT | (m_edge_trigger ? (uint32_t) EPOLLET : 0u);
         auto ret = epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ee);
         if (-1 == ret) {
             SYS("epoll_ctl r2w error fd[%d] errno[%d]", fd, errno);
@@ -263,10 +802,10 @@ private:
         return true;
     }
 
-    bool w2r_event(int fd) const {
+    bool w2r_event(int fd, const event_loop_info_t *info) const {
         struct epoll_event ee{};
-        ee.data.fd = fd;
-        ee.events = EPOLLIN;
+        ee.data.u64 = m_info_tbl.conn_id(fd);
+        ee.events = (info->paused ? 0u : EPOLLIN) | (m_edge_trigger ? (uint32_t) EPOLLET : 0u);
         auto ret = epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ee);
         if (-1 == ret) {
             SYS("epoll_ctl w2r error fd[%d] errno[%d]", fd, errno);
@@ -275,24 +814,40 @@ private:
         return true;
     }
 
-    typedef struct {
-        Buffer *rbuf;
-        Buffer *wbuf;
-        int stat;
-    } event_loop_info_t;
-
     int m_epfd = -1;
     int m_epsz = 0;
     struct epoll_event *m_epee = nullptr;
 
-    int m_svr_fd = 0;
+    int m_svr_fd = -1;
     TcpServer m_ts{};
 
+    int m_wake_fd = -1;
+    std::atomic<bool> m_is_stop{false};
+    bool m_edge_trigger = false;
+    bool m_cork = false;
+    uint32_t m_zc_threshold = 0;
+    uint32_t m_high_mark = 0;
+    uint32_t m_low_mark = 0;
+    bool m_pause_read = false;
+    std::vector<int> m_dirty{};
+    std::vector<int> m_flushing{};
+    std::vector<linger_t> m_linger{};
+    std::vector<uint64_t> m_fanout{};
+    TopicTable m_topics{};
+    uint32_t m_max_buf_size = 4u << 20;
+    int m_wait_mode = EPOLL_WAIT_BUSY_POLL;
+    int m_wait_ms = 0;
+    uint32_t m_idle_ms = 0;
+    uint64_t m_now_ms = 0;
+    Timer m_timer{};
+
     std::function<void(int)> m_init_func = nullptr;
     std::function<void(int)> m_exit_func = nullptr;
     std::function<void(int, Buffer*)> m_recv_func = nullptr;
+    std::function<void(int)> m_blocked_func = nullptr;
+    std::function<void(int)> m_drained_func = nullptr;
 
-    std::map<int, event_loop_info_t> m_info_map{};
+    ConnTable<event_loop_info_t> m_info_tbl{};
 };
 
 #endif //UTILS_EVENTLOOP_H
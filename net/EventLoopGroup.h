@@ -0,0 +1,128 @@
+//
+// Multi-reactor front end: N EventLoops, one pinned and named thread each.
+//
+
+#ifndef UTILS_EVENTLOOPGROUP_H
+#define UTILS_EVENTLOOPGROUP_H
+
+#include "EventLoop.h"
+#include "Affinity.h"
+
+#include <thread>
+#include <vector>
+#include <functional>
+
+// Every loop opens its own SO_REUSEPORT listener on the same port, so the
+// kernel shards new connections across loops and a connection never leaves
+// the loop that accepted it. Callbacks run on the owning loop's thread and
+// receive that loop, which is the one to use for send_data.
+class EventLoopGroup {
+public:
+    bool init(uint16_t port, int epsz, uint32_t size) {
+        for (uint32_t idx = 0; idx < size; ++idx) {
+            auto loop = new EventLoop;
+            m_loops.push_back(loop);
+            if (!loop->init(port, epsz, true)) {
+                SYS("event loop[%u] init failed", idx);
+                // loop exits itself on a failed init, the others are up
+                for (auto done : m_loops) {
+                    if (done != loop) done->exit();
+                    delete done;
+                }
+                m_loops.clear();
+                return false;
+            }
+        }
+        return !m_loops.empty();
+    }
+
+    void on_connect(std::function<void(EventLoop*, int)> &&init_func) {
+        m_init_func = init_func;
+    }
+
+    void on_message(std::function<void(EventLoop*, int, Buffer*)> &&recv_func) {
+        m_recv_func = recv_func;
+    }
+
+    void on_disconnect(std::function<void(EventLoop*, int)> &&exit_func) {
+        m_exit_func = exit_func;
+    }
+
+    void set_wait_mode(int mode, int wait_ms=0) {
+        for (auto loop : m_loops) {
+            loop->set_wait_mode(mode, wait_ms);
+        }
+    }
+
+    // before start, overrides the first_cpu placement (see Affinity.h).
+    void set_affinity(int policy, const std::vector<int> &cpus={}) {
+        m_policy = policy;
+        m_cpus = cpus;
+    }
+
+    // loop i on cpu first_cpu + i, first_cpu < 0 leaves placement to the
+    // scheduler. Threads are named loop-<i>.
+    void start(int first_cpu=0) {
+        auto policy = m_policy;
+        auto cpus = m_cpus;
+        if (policy == AFFINITY_NONE && first_cpu >= 0) {
+            policy = AFFINITY_CPU_LIST;
+            cpus.clear();
+            auto ncpu = (int) std::thread::hardware_concurrency();
+            for (uint32_t idx = 0; idx < m_loops.size(); ++idx) {
+                cpus.push_back((first_cpu + (int) idx) % (ncpu > 0 ? ncpu : 1));
+            }
+        }
+        auto places = Affinity::plan(policy, size(), cpus);
+        for (uint32_t idx = 0; idx < m_loops.size(); ++idx) {
+            auto loop = m_loops[idx];
+            loop->on_connect([this, loop](int fd) { m_init_func(loop, fd); });
+            loop->on_message([this, loop](int fd, Buffer *buf) { m_recv_func(loop, fd, buf); });
+            loop->on_disconnect([this, loop](int fd) { m_exit_func(loop, fd); });
+            m_thrds.emplace_back(std::thread(std::bind(&EventLoopGroup::run_loop, this, loop, idx, places[idx])));
+        }
+    }
+
+    void exit() {
+        for (auto loop : m_loops) {
+            loop->stop();
+        }
+        for (auto &&thrd : m_thrds) {
+            if (thrd.joinable()) {
+                thrd.join();
+            }
+        }
+        m_thrds.clear();
+        for (auto loop : m_loops) {
+            loop->exit();
+            delete loop;
+        }
+        m_loops.clear();
+    }
+
+    EventLoop *loop(uint32_t idx) const {
+        return m_loops[idx];
+    }
+
+    uint32_t size() const {
+        return (uint32_t) m_loops.size();
+    }
+
+private:
+    void run_loop(EventLoop *loop, uint32_t idx, Affinity::placement_t place) {
+        Affinity::apply(place);
+        Affinity::set_name("loop", idx);
+        loop->run();
+    }
+
+    int m_policy = AFFINITY_NONE;
+    std::vector<int> m_cpus{};
+    std::vector<EventLoop*> m_loops{};
+    std::vector<std::thread> m_thrds{};
+
+    std::function<void(EventLoop*, int)> m_init_func = nullptr;
+    std::function<void(EventLoop*, int)> m_exit_func = nullptr;
+    std::function<void(EventLoop*, int, Buffer*)> m_recv_func = nullptr;
+};
+
+#endif //UTILS_EVENTLOOPGROUP_H
@@ -0,0 +1,224 @@
+//
+// Message framing on top of a connection's receive Buffer.
+//
+
+#ifndef UTILS_FRAMECODEC_H
+#define UTILS_FRAMECODEC_H
+
+#include "Buffer.h"
+#include "log_std.h"
+
+#include <vector>
+#include <functional>
+
+enum {
+    FRAME_LENGTH_PREFIX,
+    FRAME_DELIMITER,
+    FRAME_FIXED_SIZE
+};
+
+// payload only, the length header or delimiter is stripped.
+struct FrameView {
+    const uint8_t *data;
+    uint32_t size;
+};
+
+// Splits the byte stream handed to on_message into frames and delivers
+// every complete frame of one read in a single on_frames call. Views
+// point into the receive buffer (a frame straddling two chunks is pulled
+// up into one) and are only valid during the call; the frames are
+// consumed afterwards. Partial frames stay in the buffer for the next read.
+// on_frames must not close the connection itself, it returns false instead
+// and the codec closes it after the buffer is no longer touched.
+// One codec can serve every connection of a loop, it keeps no per-fd state.
+class FrameCodec {
+public:
+    // header_size bytes of header, carrying a len_size (1, 2 or 4) byte
+    // length at len_offset. The length counts the payload only unless
+    // len_includes_header. max_frame includes the header.
+    bool init_length_prefix(uint32_t header_size, uint32_t len_offset, uint32_t len_size,
+                            bool len_includes_header=false, bool big_endian=true,
+                            uint32_t max_frame=1u << 20) {
+        if ((len_size != 1 && len_size != 2 && len_size != 4) ||
+            len_offset > header_size || header_size - len_offset < len_size ||
+            max_frame < header_size) {
+            SYS("bad length prefix header[%u] offset[%u] size[%u] max[%u]",
+                header_size, len_offset, len_size, max_frame);
+            return false;
+        }
+        m_mode = FRAME_LENGTH_PREFIX;
+        m_header_size = header_size;
+        m_len_offset = len_offset;
+        m_len_size = len_size;
+        m_len_includes_header = len_includes_header;
+        m_big_endian = big_endian;
+        m_max_frame = max_frame;
+        return true;
+    }
+
+    bool init_delimiter(const void *delim, uint32_t delim_size, uint32_t max_frame=1u << 20) {
+        if (delim_size == 0) {
+            SYS("empty frame delimiter");
+            return false;
+        }
+        m_mode = FRAME_DELIMITER;
+        m_delim.assign((const uint8_t*) delim, (const uint8_t*) delim + delim_size);
+        m_max_frame = max_frame;
+        return true;
+    }
+
+    // frame_size 0 would never consume anything.
+    bool init_fixed_size(uint32_t frame_size) {
+        if (frame_size == 0) {
+            SYS("zero frame size");
+            return false;
+        }
+        m_mode = FRAME_FIXED_SIZE;
+        m_frame_size = frame_size;
+        m_max_frame = frame_size;
+        return true;
+    }
+
+    void on_frames(std::function<bool(int, const FrameView*, uint32_t)> &&frames_func) {
+        m_frames_func = frames_func;
+    }
+
+    // installs decode as the loop's on_message handler.
+    template <typename LOOP>
+    void attach(LOOP &loop) {
+        loop.on_message([this, &loop](int fd, Buffer *buf) {
+            if (!decode(fd, buf)) {
+                loop.force_close_connection(fd);
+            }
+        });
+    }
+
+    // false on a malformed or oversized frame, or when on_frames asked to
+    // close; the connection should then be closed.
+    bool decode(int fd, Buffer *buf) {
+        for (;;) {
+            m_views.clear();
+            auto span = buf->readable_span();
+            uint32_t off = 0;
+            for (;;) {
+                uint32_t len, skip, size;
+                auto ret = next_frame(buf, off, &len, &skip, &size);
+                if (ret < 0) {
+                    SYS("fd[%d] bad frame", fd);
+                    return false;
+                }
+                if (ret == 0) break;
+                if (off + len > span.size) {
+                    // deliver what is contiguous first, then pull up the rest
+                    if (!m_views.empty()) break;
+                    span.data = buf->pullup(len);
+                    span.size = len;
+                }
+                m_views.push_back({span.data + off + skip, size});
+                off += len;
+            }
+            if (m_views.empty()) return true;
+            auto ok = m_frames_func(fd, m_views.data(), (uint32_t) m_views.size());
+            buf->consume(off);
+            if (!ok) return false;
+        }
+    }
+
+private:
+    // 1 with the frame at off, 0 if incomplete, -1 if malformed.
+    int next_frame(Buffer *buf, uint32_t off, uint32_t *len, uint32_t *skip, uint32_t *size) const {
+        auto ava = buf->avail() - off;
+        switch (m_mode) {
+            case FRAME_LENGTH_PREFIX: {
+                if (ava < m_header_size) return 0;
+                uint8_t raw[4];
+                buf->peek(raw, m_len_size, off + m_len_offset);
+                uint32_t val = 0;
+                for (uint32_t idx = 0; idx < m_len_size; ++idx) {
+                    auto byte = m_big_endian ? raw[idx] : raw[m_len_size - 1 - idx];
+                    val = (val << 8) | byte;
+                }
+                if (m_len_includes_header) {
+                    if (val < m_header_size) return -1;
+                    val -= m_header_size;
+                }
+                if (val > m_max_frame - m_header_size) return -1;
+                if (ava - m_header_size < val) return 0;
+                *skip = m_header_size;
+                *size = val;
+                *len = m_header_size + val;
+                return 1;
+            }
+            case FRAME_DELIMITER:
+                return find_delim(buf, off, ava, len, size, skip);
+            case FRAME_FIXED_SIZE:
+                if (ava < m_frame_size) return 0;
+                *skip = 0;
+                *size = *len = m_frame_size;
+                return 1;
+            default:
+                return -1;
+        }
+    }
+
+    // resumes where the last search of a partial frame stopped (see
+    // Buffer::scanned), so a big frame arriving in pieces is scanned once.
+    int find_delim(Buffer *buf, uint32_t off, uint32_t ava,
+                   uint32_t *len, uint32_t *size, uint32_t *skip) const {
+        auto dsize = (uint32_t) m_delim.size();
+        uint8_t tmp[64];
+        struct iovec iov[16];
+        uint32_t pos = buf->scanned() > off ? buf->scanned() - off : 0;
+        while (pos < ava) {
+            auto cnt = buf->readable_iov(iov, 16, off + pos);
+            for (int idx = 0; idx < cnt; ++idx) {
+                auto base = (const uint8_t*) iov[idx].iov_base;
+                auto end = base + iov[idx].iov_len;
+                for (auto cur = base; cur < end; ++cur) {
+                    cur = (const uint8_t*) memchr(cur, m_delim[0], end - cur);
+                    if (!cur) break;
+                    auto at = pos + (uint32_t) (cur - base);
+                    if (at > m_max_frame) return -1;
+                    if (ava - at < dsize) {
+                        buf->set_scanned(off + at);
+                        return 0;
+                    }
+                    if (dsize == 1 || match_delim(buf, off + at, tmp)) {
+                        *skip = 0;
+                        *size = at;
+                        *len = at + dsize;
+                        return 1;
+                    }
+                }
+                pos += (uint32_t) iov[idx].iov_len;
+            }
+        }
+        buf->set_scanned(off + ava);
+        return ava > m_max_frame + dsize ? -1 : 0;
+    }
+
+    bool match_delim(const Buffer *buf, uint32_t at, uint8_t *tmp) const {
+        auto dsize = (uint32_t) m_delim.size();
+        for (uint32_t done = 0; done < dsize; done += 64) {
+            auto part = dsize - done < 64 ? dsize - done : 64;
+            buf->peek(tmp, part, at + done);
+            if (memcmp(tmp, m_delim.data() + done, part) != 0) return false;
+        }
+        return true;
+    }
+
+    int m_mode = FRAME_LENGTH_PREFIX;
+    uint32_t m_header_size = 4;
+    uint32_t m_len_offset = 0;
+    uint32_t m_len_size = 4;
+    bool m_len_includes_header = false;
+    bool m_big_endian = true;
+    uint32_t m_frame_size = 0;
+    uint32_t m_max_frame = 1u << 20;
+    std::vector<uint8_t> m_delim{};
+
+    std::vector<FrameView> m_views{};
+    std::function<bool(int, const FrameView*, uint32_t)> m_frames_func = nullptr;
+};
+
+#endif //UTILS_FRAMECODEC_H
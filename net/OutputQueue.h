@@ -0,0 +1,219 @@
+//
+// Per-connection output queue: copied bytes and referenced payloads.
+//
+
+#ifndef UTILS_OUTPUTQUEUE_H
+#define UTILS_OUTPUTQUEUE_H
+
+#include "Buffer.h"
+
+#include <new>
+#include <atomic>
+#include <deque>
+
+#include <sys/uio.h>
+
+// Immutable, refcounted bytes that can sit in many output queues at once
+// (and across loop threads). create() copies once into an inline block,
+// wrap() references caller memory and calls free_func on the last release.
+class SharedPayload {
+public:
+    typedef void (*free_func_t)(void *arg, const void *data);
+
+    static SharedPayload *create(const void *buf, uint32_t size) {
+        auto mem = malloc(sizeof(SharedPayload) + size);
+        auto payload = new (mem) SharedPayload((uint8_t*) mem + sizeof(SharedPayload), size, nullptr, nullptr);
+        memcpy((uint8_t*) mem + sizeof(SharedPayload), buf, size);
+        return payload;
+    }
+
+    static SharedPayload *wrap(const void *buf, uint32_t size, free_func_t free_func, void *arg) {
+        auto mem = malloc(sizeof(SharedPayload));
+        return new (mem) SharedPayload((const uint8_t*) buf, size, free_func, arg);
+    }
+
+    void add_ref() {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (m_free_func) {
+                m_free_func(m_arg, m_data);
+            }
+            this->~SharedPayload();
+            free(this);
+        }
+    }
+
+    const uint8_t *data() const {
+        return m_data;
+    }
+
+    uint32_t size() const {
+        return m_size;
+    }
+
+private:
+    SharedPayload(const uint8_t *data, uint32_t size, free_func_t free_func, void *arg) :
+        m_data(data), m_size(size), m_free_func(free_func), m_arg(arg) {}
+
+    std::atomic<uint32_t> m_refs{1};
+    const uint8_t *m_data;
+    uint32_t m_size;
+    free_func_t m_free_func;
+    void *m_arg;
+};
+
+// Ordered list of segments, each either a run of bytes copied into the
+// connection's Buffer or a reference to a SharedPayload. Both kinds flush
+// together through one iovec array. limit caps the queued bytes of both
+// kinds together. Payloads sent with MSG_ZEROCOPY stay referenced until
+// the kernel reports the send complete; the owner must not destroy the
+// queue before zerocopy_pending() turns false (see EventLoop::linger).
+class OutputQueue {
+public:
+    explicit OutputQueue(uint32_t limit) : m_buf(limit), m_limit(limit) {}
+
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue &operator=(const OutputQueue&) = delete;
+
+    ~OutputQueue() {
+        for (auto &&seg : m_segs) {
+            if (seg.ref) seg.ref->release();
+        }
+        for (auto &&zc : m_zc) {
+            zc.ref->release();
+        }
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    uint32_t avail() const {
+        return m_size;
+    }
+
+    // false when the limit would be exceeded.
+    bool put(const void *buf, uint32_t size) {
+        if (m_limit - m_size < size || m_buf.remain() < size) return false;
+        if (size == 0) return true;
+        m_buf.put(buf, size);
+        if (!m_segs.empty() && !m_segs.back().ref) {
+            m_segs.back().size += size;
+        } else {
+            m_segs.push_back({nullptr, 0, size});
+        }
+        m_size += size;
+        return true;
+    }
+
+    bool put(SharedPayload *payload, uint32_t offset=0) {
+        if (payload->size() <= offset) return true;
+        auto size = payload->size() - offset;
+        if (m_limit - m_size < size) return false;
+        payload->add_ref();
+        m_segs.push_back({payload, offset, size});
+        m_size += size;
+        return true;
+    }
+
+    int readable_iov(struct iovec *iov, int cnt) const {
+        int num = 0;
+        uint32_t buf_off = 0;
+        for (auto it = m_segs.begin(); it != m_segs.end() && num < cnt; ++it) {
+            if (it->ref) {
+                iov[num].iov_base = (void*) (it->ref->data() + it->off);
+                iov[num].iov_len = it->size;
+                ++num;
+            } else {
+                num += m_buf.readable_iov(iov + num, cnt - num, buf_off, it->size);
+                buf_off += it->size;
+            }
+        }
+        return num;
+    }
+
+    void consume(uint32_t size) {
+        m_size -= size;
+        while (size > 0) {
+            auto &seg = m_segs.front();
+            auto len = seg.size < size ? seg.size : size;
+            if (seg.ref) {
+                seg.off += len;
+            } else {
+                m_buf.consume(len);
+            }
+            seg.size -= len;
+            size -= len;
+            if (seg.size == 0) {
+                if (seg.ref) seg.ref->release();
+                m_segs.pop_front();
+            }
+        }
+    }
+
+    // zero copy only ever covers leading payload segments of at least
+    // threshold bytes, copied bytes are recycled as soon as they are sent.
+    bool front_zerocopy(uint32_t threshold) const {
+        return !m_segs.empty() && m_segs.front().ref && m_segs.front().size >= threshold;
+    }
+
+    int zerocopy_iov(struct iovec *iov, int cnt, uint32_t threshold) const {
+        int num = 0;
+        for (auto it = m_segs.begin(); it != m_segs.end() && num < cnt; ++it) {
+            if (!it->ref || it->size < threshold) break;
+            iov[num].iov_base = (void*) (it->ref->data() + it->off);
+            iov[num].iov_len = it->size;
+            ++num;
+        }
+        return num;
+    }
+
+    // after a successful MSG_ZEROCOPY sendmsg of size bytes.
+    void consume_zerocopy(uint32_t size) {
+        auto left = size;
+        for (auto it = m_segs.begin(); left > 0; ++it) {
+            it->ref->add_ref();
+            m_zc.push_back({m_zc_seq, it->ref});
+            left -= it->size < left ? it->size : left;
+        }
+        ++m_zc_seq;
+        consume(size);
+    }
+
+    bool zerocopy_pending() const {
+        return !m_zc.empty();
+    }
+
+    // kernel completion for sendmsg calls [lo, hi], in send order on TCP.
+    void complete_zerocopy(uint32_t lo, uint32_t hi) {
+        (void) lo;
+        while (!m_zc.empty() && (int32_t) (m_zc.front().seq - hi) <= 0) {
+            m_zc.front().ref->release();
+            m_zc.pop_front();
+        }
+    }
+
+private:
+    typedef struct {
+        SharedPayload *ref;     // nullptr: bytes are in m_buf
+        uint32_t off;
+        uint32_t size;
+    } out_seg_t;
+
+    typedef struct {
+        uint32_t seq;
+        SharedPayload *ref;
+    } zc_pending_t;
+
+    Buffer m_buf;
+    uint32_t m_limit;
+    uint32_t m_size = 0;
+    uint32_t m_zc_seq = 0;
+    std::deque<out_seg_t> m_segs{};
+    std::deque<zc_pending_t> m_zc{};
+};
+
+#endif //UTILS_OUTPUTQUEUE_H
@@ -0,0 +1,148 @@
+//
+// Startup-selectable reactor backend: epoll (EventLoop) or io_uring (UringLoop).
+//
+
+#ifndef UTILS_REACTOR_H
+#define UTILS_REACTOR_H
+
+#include "EventLoop.h"
+#include "UringLoop.h"
+
+enum {
+    REACTOR_EPOLL,
+    REACTOR_IO_URING
+};
+
+#ifdef UTILS_HAS_IO_URING
+#define URING_OR_EPOLL(call) \
+    if (m_backend == REACTOR_IO_URING) return m_uring.call; \
+    return m_epoll.call
+#else
+#define URING_OR_EPOLL(call) return m_epoll.call
+#endif
+
+// Forwards the common EventLoop surface to the chosen backend. Asking for
+// io_uring falls back to epoll when liburing was missing at build time or
+// the running kernel lacks what UringLoop needs; backend() reports which
+// one is in use. Callbacks must be set before init.
+class Reactor {
+public:
+    bool init(int backend, uint16_t port, int epsz, bool reuseport=false) {
+#ifdef UTILS_HAS_IO_URING
+        if (backend == REACTOR_IO_URING) {
+            m_uring.on_connect(std::function<void(int)>(m_init_func));
+            m_uring.on_message(std::function<void(int, Buffer*)>(m_recv_func));
+            m_uring.on_disconnect(std::function<void(int)>(m_exit_func));
+            if (m_uring.init(port, epsz, reuseport)) {
+                m_backend = REACTOR_IO_URING;
+                return true;
+            }
+            m_uring.exit();
+            WRN("Reactor: io_uring unavailable, fall back to epoll");
+        }
+#else
+        if (backend == REACTOR_IO_URING) {
+            WRN("Reactor: built without liburing, fall back to epoll");
+        }
+#endif
+        m_backend = REACTOR_EPOLL;
+        m_epoll.on_connect(std::function<void(int)>(m_init_func));
+        m_epoll.on_message(std::function<void(int, Buffer*)>(m_recv_func));
+        m_epoll.on_disconnect(std::function<void(int)>(m_exit_func));
+        return m_epoll.init(port, epsz, reuseport);
+    }
+
+    int backend() const {
+        return m_backend;
+    }
+
+    void on_connect(std::function<void(int)> &&init_func) {
+        m_init_func = init_func;
+    }
+
+    void on_message(std::function<void(int, Buffer*)> &&recv_func) {
+        m_recv_func = recv_func;
+    }
+
+    void on_disconnect(std::function<void(int)> &&exit_func) {
+        m_exit_func = exit_func;
+    }
+
+    void set_wait_mode(int mode, int wait_ms=0) {
+        m_epoll.set_wait_mode(mode, wait_ms);
+#ifdef UTILS_HAS_IO_URING
+        m_uring.set_wait_mode(mode, wait_ms);
+#endif
+    }
+
+    void loop() {
+        URING_OR_EPOLL(loop());
+    }
+
+    void run() {
+        URING_OR_EPOLL(run());
+    }
+
+    void stop() {
+        URING_OR_EPOLL(stop());
+    }
+
+    bool send_data(int fd, const void *buf, uint32_t size) {
+        URING_OR_EPOLL(send_data(fd, buf, size));
+    }
+
+    bool send_data(int fd, SharedPayload *payload) {
+        URING_OR_EPOLL(send_data(fd, payload));
+    }
+
+    void broadcast(std::function<void(int)> &&func) {
+        URING_OR_EPOLL(broadcast(std::move(func)));
+    }
+
+    void broadcast(SharedPayload *payload) {
+        URING_OR_EPOLL(broadcast(payload));
+    }
+
+    bool subscribe(int fd, uint32_t topic) {
+        URING_OR_EPOLL(subscribe(fd, topic));
+    }
+
+    bool unsubscribe(int fd, uint32_t topic) {
+        URING_OR_EPOLL(unsubscribe(fd, topic));
+    }
+
+    void publish(uint32_t topic, SharedPayload *payload) {
+        URING_OR_EPOLL(publish(topic, payload));
+    }
+
+    uint64_t conn_id(int fd) const {
+        URING_OR_EPOLL(conn_id(fd));
+    }
+
+    int conn_fd(uint64_t conn_id) const {
+        URING_OR_EPOLL(conn_fd(conn_id));
+    }
+
+    void force_close_connection(int fd) {
+        URING_OR_EPOLL(force_close_connection(fd));
+    }
+
+    void exit() {
+        URING_OR_EPOLL(exit());
+    }
+
+private:
+    int m_backend = REACTOR_EPOLL;
+    EventLoop m_epoll{};
+#ifdef UTILS_HAS_IO_URING
+    UringLoop m_uring{};
+#endif
+
+    std::function<void(int)> m_init_func = nullptr;
+    std::function<void(int)> m_exit_func = nullptr;
+    std::function<void(int, Buffer*)> m_recv_func = nullptr;
+};
+
+#undef URING_OR_EPOLL
+
+#endif //UTILS_REACTOR_H
@@ -5,17 +5,21 @@
 #ifndef UTILS_TCPSERVER_H
 #define UTILS_TCPSERVER_H
 
+#include <cerrno>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 
 class TcpServer {
 public:
     explicit TcpServer() = default;
     ~TcpServer() = default;
 
-    bool init(uint16_t port, bool nonblock=false) {
+    // reuseport lets several listeners (one per reactor) bind the same port,
+    // the kernel then hashes incoming connections across them.
+    bool init(uint16_t port, bool nonblock=false, bool reuseport=false) {
         m_nonblock_mode = nonblock;
         int sock_type = SOCK_STREAM | SOCK_CLOEXEC;
         if (m_nonblock_mode) {
@@ -26,18 +30,23 @@ public:
 
         const int on = 1;
         auto ret = setsockopt(m_sock_fd, SOL_TCP, TCP_NODELAY, &on, sizeof(on));
-        if (-1 == ret) return false;
+        if (-1 == ret) return fail();
         ret = setsockopt(m_sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-        if (-1 == ret) return false;
+        if (-1 == ret) return fail();
+        if (reuseport) {
+            ret = setsockopt(m_sock_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            if (-1 == ret) return fail();
+        }
 
         struct sockaddr_in addr{};
         addr.sin_family = AF_INET;
         addr.sin_port = htons(port);
         addr.sin_addr.s_addr = INADDR_ANY;
         ret = bind(m_sock_fd, (const struct sockaddr*) &addr, sizeof(addr));
-        if (-1 == ret) return false;
+        if (-1 == ret) return fail();
         ret = listen(m_sock_fd, SOMAXCONN);
-        return -1 != ret;
+        if (-1 == ret) return fail();
+        return true;
     }
 
     int accept() const {
@@ -53,8 +62,17 @@ public:
     }
 
 private:
-    int m_sock_fd;
-    bool m_nonblock_mode;
+    // closes the half set up socket, keeping errno for the caller.
+    bool fail() {
+        auto err = errno;
+        close(m_sock_fd);
+        m_sock_fd = -1;
+        errno = err;
+        return false;
+    }
+
+    int m_sock_fd = -1;
+    bool m_nonblock_mode = false;
 };
 
 #endif//UTILS_TCPSERVER_H
@@ -0,0 +1,220 @@
+//
+// Hierarchical timing wheel driven by the owning EventLoop.
+//
+
+#ifndef UTILS_TIMER_H
+#define UTILS_TIMER_H
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+#include <time.h>
+
+// Four levels of 64 slots at 1 ms resolution, the same layout the kernel
+// timer wheel uses: add and cancel are O(1), and a slot of level N is
+// cascaded into level N-1 each time the level below wraps. Deadlines past
+// the last level are parked there and re-placed when they cascade.
+// Not thread safe, all calls must come from the owning loop thread.
+class Timer {
+public:
+    static uint64_t now_ms() {
+        struct timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000u + ts.tv_nsec / 1000000u;
+    }
+
+    void init(uint64_t now) {
+        m_cur = now;
+        m_heads.assign(LEVELS * SLOTS + 1, -1);
+    }
+
+    // returns a timer id (never 0), interval 0 means one-shot. delay counts
+    // from now, the wheel itself only catches up on the next advance().
+    uint64_t add(uint64_t now, uint64_t delay, uint64_t interval, std::function<void()> &&func) {
+        int32_t idx;
+        if (m_free != -1) {
+            idx = m_free;
+            m_free = m_nodes[idx].next;
+        } else {
+            idx = (int32_t) m_nodes.size();
+            m_nodes.emplace_back();
+        }
+        auto node = &m_nodes[idx];
+        node->expire = now + delay;
+        node->interval = interval;
+        node->func = std::move(func);
+        place(idx);
+        ++m_size;
+        return ((uint64_t) node->gen << 32) | (uint32_t) idx;
+    }
+
+    void cancel(uint64_t id) {
+        auto idx = (int32_t) (uint32_t) id;
+        if (id == 0 || (size_t) idx >= m_nodes.size()) return;
+        auto node = &m_nodes[idx];
+        if (node->gen != (uint32_t) (id >> 32) || node->list == LIST_FREE) return;
+        if (node->list == LIST_FIRING) {
+            // released by advance() once the callback returns
+            node->interval = 0;
+            return;
+        }
+        unlink(idx);
+        release(idx);
+    }
+
+    // fires every timer due at or before now.
+    void advance(uint64_t now) {
+        while (m_size > 0 && m_cur <= now) {
+            auto slot = m_cur & MASK;
+            if (slot == 0) {
+                for (int lvl = 1; lvl < LEVELS; ++lvl) {
+                    auto lvl_slot = (m_cur >> (lvl * BITS)) & MASK;
+                    cascade(lvl * SLOTS + (int) lvl_slot);
+                    if (lvl_slot != 0) break;
+                }
+            }
+            // move due timers aside first, so callbacks adding zero-delay
+            // timers land in the next tick instead of this one.
+            auto head = m_heads[slot];
+            while (head != -1) {
+                unlink(head);
+                link(head, EXPIRED);
+                head = m_heads[slot];
+            }
+            ++m_cur;
+            fire();
+        }
+        if (m_cur <= now) {
+            m_cur = now + 1;
+        }
+    }
+
+    // ms until the earliest possible deadline, -1 when no timer is pending.
+    // May be early for timers in upper levels, advance() then cascades them.
+    int64_t next_timeout(uint64_t now) const {
+        if (m_size == 0) return -1;
+        int64_t best = -1;
+        for (int lvl = 0; lvl < LEVELS; ++lvl) {
+            auto shift = lvl * BITS;
+            auto base = m_cur >> shift;
+            for (uint64_t dist = 0; dist < SLOTS; ++dist) {
+                if (m_heads[lvl * SLOTS + (int) ((base + dist) & MASK)] == -1) continue;
+                auto tick = lvl == 0 ? m_cur + dist : (base + dist) << shift;
+                // current upper slot already cascaded this round, due next round
+                auto wrapped = tick < m_cur;
+                if (wrapped) tick += (uint64_t) SLOTS << shift;
+                auto wait = tick > now ? (int64_t) (tick - now) : 0;
+                if (best == -1 || wait < best) best = wait;
+                if (!wrapped) break;
+            }
+        }
+        return best;
+    }
+
+    uint32_t size() const {
+        return m_size;
+    }
+
+private:
+    static constexpr int BITS = 6;
+    static constexpr int SLOTS = 1 << BITS;
+    static constexpr uint64_t MASK = SLOTS - 1;
+    static constexpr int LEVELS = 4;
+    static constexpr int EXPIRED = LEVELS * SLOTS;
+    static constexpr int32_t LIST_FREE = -1;
+    static constexpr int32_t LIST_FIRING = -2;
+
+    typedef struct {
+        uint64_t expire = 0;
+        uint64_t interval = 0;
+        std::function<void()> func = nullptr;
+        int32_t prev = -1;
+        int32_t next = -1;
+        int32_t list = LIST_FREE;
+        uint32_t gen = 1;
+    } timer_node_t;
+
+    void place(int32_t idx) {
+        auto node = &m_nodes[idx];
+        if (node->expire < m_cur) node->expire = m_cur;
+        auto diff = node->expire - m_cur;
+        auto expire = node->expire;
+        int lvl = 0;
+        while (lvl < LEVELS - 1 && diff >= ((uint64_t) 1 << ((lvl + 1) * BITS))) {
+            ++lvl;
+        }
+        if (diff >= ((uint64_t) 1 << (LEVELS * BITS))) {
+            expire = m_cur + ((uint64_t) 1 << (LEVELS * BITS)) - 1;
+        }
+        link(idx, lvl * SLOTS + (int) ((expire >> (lvl * BITS)) & MASK));
+    }
+
+    void cascade(int list) {
+        auto head = m_heads[list];
+        while (head != -1) {
+            unlink(head);
+            place(head);
+            head = m_heads[list];
+        }
+    }
+
+    void fire() {
+        auto head = m_heads[EXPIRED];
+        while (head != -1) {
+            unlink(head);
+            m_nodes[head].list = LIST_FIRING;
+            // callbacks may add timers and grow m_nodes, so run a moved-out copy.
+            auto func = std::move(m_nodes[head].func);
+            func();
+            auto node = &m_nodes[head];
+            if (node->interval > 0) {
+                node->expire += node->interval;
+                node->func = std::move(func);
+                place(head);
+            } else {
+                release(head);
+            }
+            head = m_heads[EXPIRED];
+        }
+    }
+
+    void link(int32_t idx, int list) {
+        auto node = &m_nodes[idx];
+        node->list = list;
+        node->prev = -1;
+        node->next = m_heads[list];
+        if (node->next != -1) m_nodes[node->next].prev = idx;
+        m_heads[list] = idx;
+    }
+
+    void unlink(int32_t idx) {
+        auto node = &m_nodes[idx];
+        if (node->prev != -1) {
+            m_nodes[node->prev].next = node->next;
+        } else {
+            m_heads[node->list] = node->next;
+        }
+        if (node->next != -1) m_nodes[node->next].prev = node->prev;
+        node->prev = node->next = -1;
+    }
+
+    void release(int32_t idx) {
+        auto node = &m_nodes[idx];
+        node->func = nullptr;
+        node->list = LIST_FREE;
+        ++node->gen;
+        if (node->gen == 0) node->gen = 1;
+        node->next = m_free;
+        m_free = idx;
+        --m_size;
+    }
+
+    uint64_t m_cur = 0;
+    uint32_t m_size = 0;
+    int32_t m_free = -1;
+    std::vector<int32_t> m_heads{};
+    std::vector<timer_node_t> m_nodes{};
+};
+
+#endif //UTILS_TIMER_H
@@ -0,0 +1,97 @@
+//
+// fd subscriptions per topic, for publish fan-out.
+//
+
+#ifndef UTILS_TOPICTABLE_H
+#define UTILS_TOPICTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+
+// Each topic keeps a dense vector of subscribed fds so publish walks only
+// its subscribers. Every fd remembers its slot in each topic vector, which
+// keeps unsubscribe and remove (on close) O(topics of that fd). A topic
+// goes away with its last subscriber.
+class TopicTable {
+public:
+    bool subscribe(int fd, uint32_t topic) {
+        auto &subs = fd_subs(fd);
+        for (auto &&sub : subs) {
+            if (sub.topic == topic) return false;
+        }
+        auto &fds = m_topics[topic];
+        subs.push_back({topic, (uint32_t) fds.size()});
+        fds.push_back(fd);
+        return true;
+    }
+
+    bool unsubscribe(int fd, uint32_t topic) {
+        auto &subs = fd_subs(fd);
+        for (size_t idx = 0; idx < subs.size(); ++idx) {
+            if (subs[idx].topic == topic) {
+                drop(fd, subs[idx]);
+                subs[idx] = subs.back();
+                subs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // on close, drops every subscription of fd.
+    void remove(int fd) {
+        if ((size_t) fd >= m_subs.size()) return;
+        auto &subs = m_subs[fd];
+        for (auto &&sub : subs) {
+            drop(fd, sub);
+        }
+        subs.clear();
+    }
+
+    // nullptr if nobody is subscribed. Gone with the topic's last
+    // subscriber, so copy it before doing anything that may close one.
+    const std::vector<int> *members(uint32_t topic) const {
+        auto it = m_topics.find(topic);
+        return it == m_topics.end() ? nullptr : &it->second;
+    }
+
+private:
+    typedef struct {
+        uint32_t topic;
+        uint32_t pos;       // index of the fd in the topic vector
+    } sub_t;
+
+    std::vector<sub_t> &fd_subs(int fd) {
+        if ((size_t) fd >= m_subs.size()) {
+            m_subs.resize(fd + 1);
+        }
+        return m_subs[fd];
+    }
+
+    void drop(int fd, const sub_t &sub) {
+        auto it = m_topics.find(sub.topic);
+        auto &fds = it->second;
+        auto last = fds.back();
+        fds[sub.pos] = last;
+        fds.pop_back();
+        if (fds.empty()) {
+            m_topics.erase(it);
+            return;
+        }
+        if (last != fd) {
+            for (auto &&other : m_subs[last]) {
+                if (other.topic == sub.topic) {
+                    other.pos = sub.pos;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::unordered_map<uint32_t, std::vector<int>> m_topics{};
+    std::vector<std::vector<sub_t>> m_subs{};
+};
+
+#endif //UTILS_TOPICTABLE_H
@@ -0,0 +1,568 @@
+//
+// io_uring reactor with the same callback/send surface as EventLoop.
+//
+
+#ifndef UTILS_URINGLOOP_H
+#define UTILS_URINGLOOP_H
+
+#include "EventLoop.h"
+
+#if __has_include(<liburing.h>)
+#include <liburing.h>
+// io_uring_version.h came with 2.4, older headers lack the buffer ring helpers
+#if defined(IO_URING_CHECK_VERSION) && !IO_URING_CHECK_VERSION(2, 4)
+#define UTILS_HAS_IO_URING 1
+#endif
+#endif
+
+#ifdef UTILS_HAS_IO_URING
+
+// Multishot accept and multishot recv into a registered provided-buffer
+// ring, output flushed as chains of linked MSG_WAITALL sends so a short
+// send cancels the rest of the chain instead of reordering bytes.
+// Needs liburing >= 2.4 and a 6.0+ kernel, init() fails otherwise and the
+// caller is expected to fall back to EventLoop (see Reactor).
+//
+// A connection stays allocated, and its fd open, until every request
+// referencing it has completed, so a closed fd number is never reused
+// while the kernel still holds requests for it.
+class UringLoop {
+public:
+    bool init(uint16_t port, int depth, bool reuseport=false) {
+        struct io_uring_params params{};
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        auto ret = io_uring_queue_init_params(depth, &m_ring, &params);
+        if (ret == -EINVAL) {
+            params.flags = 0;
+            ret = io_uring_queue_init_params(depth, &m_ring, &params);
+        }
+        if (ret < 0) {
+            SYS("io_uring init error[%d]", -ret);
+            return false;
+        }
+        m_ring_ok = true;
+        if (!probe()) return false;
+
+        m_br = io_uring_setup_buf_ring(&m_ring, br_entries, br_group, 0, &ret);
+        if (!m_br) {
+            SYS("io_uring buffer ring error[%d]", -ret);
+            return false;
+        }
+        m_br_mem = (uint8_t*) malloc((size_t) br_entries * br_buf_size);
+        for (uint32_t bid = 0; bid < br_entries; ++bid) {
+            io_uring_buf_ring_add(m_br, m_br_mem + (size_t) bid * br_buf_size, br_buf_size,
+                                  bid, io_uring_buf_ring_mask(br_entries), bid);
+        }
+        io_uring_buf_ring_advance(m_br, br_entries);
+        if (!probe_recv_multishot()) {
+            SYS("io_uring lacks multishot recv");
+            return false;
+        }
+
+        if (!m_ts.init(port, true, reuseport)) {
+            SYS("listen port[%u] errno[%d]", port, errno);
+            return false;
+        }
+        m_svr_fd = m_ts.get_sock_fd();
+        m_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (-1 == m_wake_fd) return false;
+        arm_accept();
+        arm_wake();
+        return true;
+    }
+
+    void on_connect(std::function<void(int)> &&init_func) {
+        m_init_func = init_func;
+    }
+
+    void on_message(std::function<void(int, Buffer*)> &&recv_func) {
+        m_recv_func = recv_func;
+    }
+
+    void on_disconnect(std::function<void(int)> &&exit_func) {
+        m_exit_func = exit_func;
+    }
+
+    // EPOLL_WAIT_TIMER blocks until a completion, there are no timers here.
+    void set_wait_mode(int mode, int wait_ms=0) {
+        m_wait_mode = mode;
+        m_wait_ms = wait_ms;
+    }
+
+    void set_max_buffer(uint32_t size) {
+        m_max_buf_size = size;
+    }
+
+    void run() {
+        while (!m_is_stop.load(std::memory_order_relaxed)) {
+            loop();
+        }
+    }
+
+    void stop() {
+        m_is_stop.store(true, std::memory_order_relaxed);
+        uint64_t one = 1;
+        (void) ::write(m_wake_fd, &one, sizeof(one));
+    }
+
+    void loop() {
+        flush_dirty();
+        struct io_uring_cqe *cqe = nullptr;
+        if (m_wait_mode == EPOLL_WAIT_BUSY_POLL) {
+            io_uring_submit(&m_ring);
+        } else if (m_wait_mode == EPOLL_WAIT_TIMEOUT) {
+            struct __kernel_timespec ts{};
+            ts.tv_sec = m_wait_ms / 1000;
+            ts.tv_nsec = (long long) (m_wait_ms % 1000) * 1000000;
+            io_uring_submit_and_wait_timeout(&m_ring, &cqe, 1, &ts, nullptr);
+        } else {
+            io_uring_submit_and_wait(&m_ring, 1);
+        }
+
+        unsigned head;
+        unsigned cnt = 0;
+        io_uring_for_each_cqe(&m_ring, head, cqe) {
+            on_complete(cqe);
+            ++cnt;
+        }
+        io_uring_cq_advance(&m_ring, cnt);
+    }
+
+    void broadcast(std::function<void(int)> &&func) {
+        std::vector<uint64_t> ids;
+        m_conn_tbl.snapshot(&ids);
+        for (auto id : ids) {
+            auto fd = m_conn_tbl.conn_fd(id);
+            if (fd >= 0) func(fd);
+        }
+    }
+
+    void broadcast(SharedPayload *payload) {
+        auto ids = take_fanout();
+        m_conn_tbl.snapshot(&ids);
+        fan_out(ids, payload);
+    }
+
+    bool subscribe(int fd, uint32_t topic) {
+        return m_conn_tbl.get(fd) && m_topics.subscribe(fd, topic);
+    }
+
+    bool unsubscribe(int fd, uint32_t topic) {
+        return m_conn_tbl.get(fd) && m_topics.unsubscribe(fd, topic);
+    }
+
+    void publish(uint32_t topic, SharedPayload *payload) {
+        auto fds = m_topics.members(topic);
+        if (!fds) return;
+        auto ids = take_fanout();
+        for (auto fd : *fds) {
+            ids.push_back(m_conn_tbl.conn_id(fd));
+        }
+        fan_out(ids, payload);
+    }
+
+    uint64_t conn_id(int fd) const {
+        return m_conn_tbl.conn_id(fd);
+    }
+
+    int conn_fd(uint64_t conn_id) const {
+        return m_conn_tbl.conn_fd(conn_id);
+    }
+
+    // always queued, every connection written to is flushed once per loop().
+    bool send_data(int fd, const void *buf, uint32_t size) {
+        auto slot = m_conn_tbl.get(fd);
+        if (!slot) {
+            SYS("send to closed fd[%d]", fd);
+            return false;
+        }
+        auto conn = *slot;
+        if (!conn->wque->put(buf, size)) {
+            SYS_RATE_LIMITED(1000, "send overflow fd[%d]", fd);
+            on_close(conn);
+            return false;
+        }
+        want_flush(conn);
+        return true;
+    }
+
+    bool send_data(int fd, SharedPayload *payload) {
+        auto slot = m_conn_tbl.get(fd);
+        if (!slot) {
+            SYS("send to closed fd[%d]", fd);
+            return false;
+        }
+        return queue_payload(*slot, payload);
+    }
+
+    void force_close_connection(int fd) {
+        auto slot = m_conn_tbl.get(fd);
+        if (slot) {
+            on_close(*slot);
+        }
+    }
+
+    void exit() {
+        if (!m_ring_ok) return;
+        // no new connections from here, ones accepted meanwhile are closed
+        // right away in on_accept
+        m_exiting = true;
+        if (m_accepting) cancel_accept();
+        while (!m_conn_tbl.empty()) {
+            force_close_connection(m_conn_tbl.live().back());
+        }
+        // let shutdown() complete outstanding requests before tearing down
+        auto mode = m_wait_mode;
+        auto wait_ms = m_wait_ms;
+        set_wait_mode(EPOLL_WAIT_TIMEOUT, 10);
+        for (int idx = 0; idx < 100 && (m_conn_cnt > 0 || m_accepting); ++idx) {
+            loop();
+        }
+        set_wait_mode(mode, wait_ms);
+        flush_dirty();
+        if (m_br) {
+            io_uring_free_buf_ring(&m_ring, m_br, br_entries, br_group);
+            m_br = nullptr;
+        }
+        io_uring_queue_exit(&m_ring);
+        m_ring_ok = false;
+        m_accepting = false;
+        m_exiting = false;
+        // the ring is gone and with it whatever never completed
+        while (!m_closed.empty()) {
+            auto conn = m_closed.back();
+            conn->refs = 0;
+            release(conn);
+        }
+        free(m_br_mem);
+        m_br_mem = nullptr;
+        if (m_svr_fd != -1) {
+            close(m_svr_fd);
+            m_svr_fd = -1;
+        }
+        if (m_wake_fd != -1) {
+            close(m_wake_fd);
+            m_wake_fd = -1;
+        }
+    }
+
+private:
+    enum {
+        URING_OP_ACCEPT,
+        URING_OP_RECV,
+        URING_OP_SEND,
+        URING_OP_WAKE,
+        URING_OP_CANCEL
+    };
+
+    typedef struct {
+        int fd;
+        uint32_t refs;      // requests in flight that point at this conn
+        uint32_t sending;   // sends of the current chain still in flight
+        bool closed;
+        bool dirty;
+        Buffer *rbuf;
+        OutputQueue *wque;
+    } uring_conn_t;
+
+    static constexpr uint32_t br_entries = 512u;
+    static constexpr uint32_t br_buf_size = 8192u;
+    static constexpr int br_group = 0;
+    static constexpr int max_link = 16;
+
+    bool probe() {
+        auto probe = io_uring_get_probe_ring(&m_ring);
+        if (!probe) return false;
+        auto ok = io_uring_opcode_supported(probe, IORING_OP_ACCEPT) &&
+                  io_uring_opcode_supported(probe, IORING_OP_RECV) &&
+                  io_uring_opcode_supported(probe, IORING_OP_SEND) &&
+                  io_uring_opcode_supported(probe, IORING_OP_READ);
+        io_uring_free_probe(probe);
+        if (!ok) {
+            SYS("io_uring lacks accept/recv/send");
+        }
+        return ok;
+    }
+
+    // the opcode probe cannot tell multishot recv apart, so run one on a
+    // socketpair whose peer is gone: EOF where supported, -EINVAL where
+    // not. Multishot accept is older (5.19) and comes along with it.
+    bool probe_recv_multishot() {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) return false;
+        close(pair[1]);
+        auto sqe = get_sqe();
+        io_uring_prep_recv_multishot(sqe, pair[0], nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = br_group;
+        io_uring_sqe_set_data64(sqe, 0);
+        io_uring_submit(&m_ring);
+        struct io_uring_cqe *cqe = nullptr;
+        auto ok = false;
+        if (io_uring_wait_cqe(&m_ring, &cqe) == 0) {
+            ok = cqe->res != -EINVAL;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                auto bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                io_uring_buf_ring_add(m_br, m_br_mem + (size_t) bid * br_buf_size, br_buf_size,
+                                      bid, io_uring_buf_ring_mask(br_entries), 0);
+                io_uring_buf_ring_advance(m_br, 1);
+            }
+            io_uring_cqe_seen(&m_ring, cqe);
+        }
+        close(pair[0]);
+        return ok;
+    }
+
+    static uint64_t tag(void *ptr, int op) {
+        return (uint64_t) (uintptr_t) ptr | (uint64_t) op;
+    }
+
+    struct io_uring_sqe *get_sqe() {
+        auto sqe = io_uring_get_sqe(&m_ring);
+        if (!sqe) {
+            io_uring_submit(&m_ring);
+            sqe = io_uring_get_sqe(&m_ring);
+        }
+        return sqe;
+    }
+
+    void arm_accept() {
+        auto sqe = get_sqe();
+        io_uring_prep_multishot_accept(sqe, m_svr_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        io_uring_sqe_set_data64(sqe, tag(nullptr, URING_OP_ACCEPT));
+        m_accepting = true;
+    }
+
+    // the multishot accept then completes without IORING_CQE_F_MORE.
+    void cancel_accept() {
+        auto sqe = get_sqe();
+        io_uring_prep_cancel64(sqe, tag(nullptr, URING_OP_ACCEPT), 0);
+        io_uring_sqe_set_data64(sqe, tag(nullptr, URING_OP_CANCEL));
+    }
+
+    void arm_wake() {
+        auto sqe = get_sqe();
+        io_uring_prep_read(sqe, m_wake_fd, &m_wake_cnt, sizeof(m_wake_cnt), 0);
+        io_uring_sqe_set_data64(sqe, tag(nullptr, URING_OP_WAKE));
+    }
+
+    void arm_recv(uring_conn_t *conn) {
+        auto sqe = get_sqe();
+        io_uring_prep_recv_multishot(sqe, conn->fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = br_group;
+        io_uring_sqe_set_data64(sqe, tag(conn, URING_OP_RECV));
+        ++conn->refs;
+    }
+
+    // ids taken up front, see EventLoop::fan_out.
+    std::vector<uint64_t> take_fanout() {
+        std::vector<uint64_t> ids;
+        ids.swap(m_fanout);
+        ids.clear();
+        return ids;
+    }
+
+    void fan_out(std::vector<uint64_t> &ids, SharedPayload *payload) {
+        for (auto id : ids) {
+            auto fd = m_conn_tbl.conn_fd(id);
+            if (fd >= 0) queue_payload(*m_conn_tbl.get(fd), payload);
+        }
+        if (ids.capacity() > m_fanout.capacity()) {
+            ids.clear();
+            m_fanout.swap(ids);
+        }
+    }
+
+    bool queue_payload(uring_conn_t *conn, SharedPayload *payload) {
+        if (!conn->wque->put(payload)) {
+            SYS_RATE_LIMITED(1000, "send overflow fd[%d]", conn->fd);
+            on_close(conn);
+            return false;
+        }
+        want_flush(conn);
+        return true;
+    }
+
+    void want_flush(uring_conn_t *conn) {
+        if (!conn->dirty) {
+            conn->dirty = true;
+            m_dirty.push_back(conn);
+        }
+    }
+
+    void flush_dirty() {
+        for (auto conn : m_dirty) {
+            conn->dirty = false;
+            if (!conn->closed && conn->sending == 0 && !conn->wque->empty()) {
+                submit_send(conn);
+            }
+            release(conn);
+        }
+        m_dirty.clear();
+    }
+
+    // one linked chain per connection at a time, the next chain is built
+    // from whatever is queued once this one has fully completed.
+    void submit_send(uring_conn_t *conn) {
+        struct iovec iov[max_link];
+        auto cnt = conn->wque->readable_iov(iov, max_link);
+        if ((int) io_uring_sq_space_left(&m_ring) < cnt) {
+            io_uring_submit(&m_ring);
+        }
+        for (int idx = 0; idx < cnt; ++idx) {
+            auto sqe = io_uring_get_sqe(&m_ring);
+            io_uring_prep_send(sqe, conn->fd, iov[idx].iov_base, iov[idx].iov_len, MSG_WAITALL | MSG_NOSIGNAL);
+            io_uring_sqe_set_data64(sqe, tag(conn, URING_OP_SEND));
+            if (idx + 1 < cnt) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            ++conn->refs;
+            ++conn->sending;
+        }
+    }
+
+    void on_complete(struct io_uring_cqe *cqe) {
+        auto data = io_uring_cqe_get_data64(cqe);
+        auto op = (int) (data & 7u);
+        auto conn = (uring_conn_t*) (uintptr_t) (data & ~(uint64_t) 7u);
+        switch (op) {
+            case URING_OP_ACCEPT:
+                on_accept(cqe);
+                break;
+            case URING_OP_RECV:
+                on_recv(conn, cqe);
+                break;
+            case URING_OP_SEND:
+                on_send(conn, cqe);
+                break;
+            case URING_OP_WAKE:
+                if (!m_is_stop.load(std::memory_order_relaxed)) arm_wake();
+                break;
+            default:
+                break;
+        }
+    }
+
+    void on_accept(struct io_uring_cqe *cqe) {
+        if (cqe->res >= 0 && m_exiting) {
+            close(cqe->res);
+        } else if (cqe->res >= 0) {
+            auto conn = new uring_conn_t{cqe->res, 0, 0, false, false,
+                                         new Buffer(m_max_buf_size), new OutputQueue(m_max_buf_size)};
+            *m_conn_tbl.open(conn->fd) = conn;
+            ++m_conn_cnt;
+            arm_recv(conn);
+            m_init_func(conn->fd);
+        } else if (cqe->res != -ECANCELED) {
+            SYS_RATE_LIMITED(1000, "accept error[%d]", -cqe->res);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            m_accepting = false;
+            if (!m_exiting) arm_accept();
+        }
+    }
+
+    void on_recv(uring_conn_t *conn, struct io_uring_cqe *cqe) {
+        auto res = cqe->res;
+        if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            auto bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            auto buf = m_br_mem + (size_t) bid * br_buf_size;
+            if (!conn->closed) {
+                if (conn->rbuf->remain() >= (uint32_t) res) {
+                    conn->rbuf->put(buf, res);
+                    m_recv_func(conn->fd, conn->rbuf);
+                } else {
+                    SYS("read buf has no enough space fd[%d]", conn->fd);
+                    on_close(conn);
+                }
+            }
+            io_uring_buf_ring_add(m_br, buf, br_buf_size, bid, io_uring_buf_ring_mask(br_entries), 0);
+            io_uring_buf_ring_advance(m_br, 1);
+        } else if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+            if (res < 0 && res != -ECONNRESET && !conn->closed) {
+                SYS("fd[%d] recv error[%d]", conn->fd, -res);
+            }
+            on_close(conn);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // -ENOBUFS (ring ran dry) ends the multishot, just rearm
+            if (!conn->closed) arm_recv(conn);
+            --conn->refs;
+            release(conn);
+        }
+    }
+
+    void on_send(uring_conn_t *conn, struct io_uring_cqe *cqe) {
+        --conn->sending;
+        if (cqe->res > 0) {
+            conn->wque->consume((uint32_t) cqe->res);
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED && !conn->closed) {
+            if (cqe->res != -ECONNRESET && cqe->res != -EPIPE) {
+                SYS("fd[%d] send error[%d]", conn->fd, -cqe->res);
+            }
+            on_close(conn);
+        }
+        if (conn->sending == 0 && !conn->closed && !conn->wque->empty()) {
+            want_flush(conn);
+        }
+        --conn->refs;
+        release(conn);
+    }
+
+    // shutdown makes outstanding recvs and sends complete, the fd itself
+    // is only closed in release() once they have.
+    void on_close(uring_conn_t *conn) {
+        if (conn->closed) return;
+        conn->closed = true;
+        m_exit_func(conn->fd);
+        m_conn_tbl.close(conn->fd);
+        m_topics.remove(conn->fd);
+        shutdown(conn->fd, SHUT_RDWR);
+        m_closed.push_back(conn);
+        release(conn);
+    }
+
+    void release(uring_conn_t *conn) {
+        if (!conn->closed || conn->refs > 0 || conn->dirty) return;
+        auto it = std::find(m_closed.begin(), m_closed.end(), conn);
+        *it = m_closed.back();
+        m_closed.pop_back();
+        close(conn->fd);
+        delete conn->rbuf;
+        delete conn->wque;
+        delete conn;
+        --m_conn_cnt;
+    }
+
+    struct io_uring m_ring{};
+    bool m_ring_ok = false;
+    struct io_uring_buf_ring *m_br = nullptr;
+    uint8_t *m_br_mem = nullptr;
+
+    int m_svr_fd = -1;
+    TcpServer m_ts{};
+    int m_wake_fd = -1;
+    uint64_t m_wake_cnt = 0;
+    std::atomic<bool> m_is_stop{false};
+    bool m_accepting = false;       // multishot accept armed
+    bool m_exiting = false;
+    int m_wait_mode = EPOLL_WAIT_BUSY_POLL;
+    int m_wait_ms = 0;
+    uint32_t m_max_buf_size = 4u << 20;
+    uint32_t m_conn_cnt = 0;
+
+    std::function<void(int)> m_init_func = nullptr;
+    std::function<void(int)> m_exit_func = nullptr;
+    std::function<void(int, Buffer*)> m_recv_func = nullptr;
+
+    ConnTable<uring_conn_t*> m_conn_tbl{};
+    std::vector<uring_conn_t*> m_dirty{};
+    std::vector<uring_conn_t*> m_closed{};     // waiting for their requests
+    std::vector<uint64_t> m_fanout{};
+    TopicTable m_topics{};
+};
+
+#endif //UTILS_HAS_IO_URING
+
+#endif //UTILS_URINGLOOP_H
@@ -3,9 +3,17 @@
 
 #include "log_std.h"
 #include "Singleton.h"
+#include "MPMCQueue.h"
 
 #include <mutex>
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <type_traits>
+#include <chrono>
+#include <thread>
 #include <condition_variable>
 
 struct ConnectionInfo {
@@ -16,56 +24,559 @@ struct ConnectionInfo {
     std::string dbname{};
 };
 
+// statement handle type of T::prepare, void* when T has none.
+template <typename T, typename = void>
+struct stmt_handle {
+    typedef void *type;
+};
+
+template <typename T>
+struct stmt_handle<T, std::void_t<decltype(std::declval<T&>().prepare(std::string()))>> {
+    typedef decltype(std::declval<T&>().prepare(std::string())) type;
+};
+
+// what the pool actually allocates: T plus its prepared statements by SQL
+// text, so a handle lives exactly as long as its connection.
+template <typename T>
+struct PooledConnection : public T {
+    std::unordered_map<std::string, typename stmt_handle<T>::type> stmts;
+};
+
+// T needs bool init(ConnectionInfo*), void exit() and set_sql; an optional
+// bool ping() is used to validate connections that sat idle. Optional
+// H prepare(sql) backs ConnectionAdapter::prepare, and run_batch needs
+// bool execute_batch(const std::vector<std::string>&) or at least
+// bool execute(const std::string&).
+//
+// The pool keeps between min and max connections. Idle ones are handed out
+// most recently used first; when none is idle and fewer than max exist, the
+// acquiring thread opens a new one. A keeper thread revalidates connections
+// idle for validate_ms, closes those idle for idle_ms beyond min, and
+// replaces dead ones, so a database restart does not leave dead handles.
+//
+// Fast path: a thread keeps up to THREAD_CACHE connections it released in
+// its own slots for its next acquire, and overflow goes to a lock-free
+// shared ring; both are tried before the mutex. The slots stay visible to
+// the pool, a waiting acquire or the keeper takes connections out of any
+// thread's slots, so a thread that stopped using the pool can not hoard
+// them. While anyone waits, release goes straight to the waiters.
 template <typename T>
 class ConnectionPool {
 public:
-    bool init(ConnectionInfo *info, uint32_t size) {
-        std::lock_guard<std::mutex> lg(m_mtx);
-        for (int idx = 0; idx < size; ++idx) {
-            auto conn = new T;
-            if (conn->init(info)) {
-                m_conns.push(conn);
+    typedef std::chrono::steady_clock steady_clock_t;
+
+    // before init. check_ms is how often the keeper looks at idle connections.
+    void set_health_check(uint32_t validate_ms, uint32_t idle_ms, uint32_t check_ms=1000) {
+        m_validate_ms = validate_ms;
+        m_idle_ms = idle_ms;
+        m_check_ms = check_ms;
+    }
+
+    ConnectionPool() = default;
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool &operator=(const ConnectionPool&) = delete;
+
+    ~ConnectionPool() {
+        exit();
+    }
+
+    // opens size connections in parallel, grows up to max_size (0: size) on
+    // demand. False, with nothing left running, when none could be opened.
+    bool init(ConnectionInfo *info, uint32_t size, uint32_t max_size=0) {
+        if (m_keeper.joinable()) {
+            SYS("Connection: pool already initialized");
+            return false;
+        }
+        m_info = *info;
+        m_min = size;
+        m_max = max_size > size ? max_size : size;
+        m_is_stop = false;
+
+        std::vector<T*> conns(size, nullptr);
+        std::vector<std::thread> thrds;
+        auto nthrd = size < MAX_INIT_THREADS ? size : (uint32_t) MAX_INIT_THREADS;
+        for (uint32_t tid = 0; tid < nthrd; ++tid) {
+            thrds.emplace_back([this, &conns, tid, nthrd] {
+                for (auto idx = tid; idx < conns.size(); idx += nthrd) {
+                    conns[idx] = create();
+                }
+            });
+        }
+        for (auto &&thrd : thrds) {
+            thrd.join();
+        }
+
+        {
+            std::lock_guard<std::mutex> lg(m_mtx);
+            auto now = steady_clock_t::now();
+            for (auto conn : conns) {
+                if (conn) m_idle.push_back({conn, now, now});
             }
+            m_total = (uint32_t) m_idle.size();
+            TRC("Connection: init connection num[%lu] success", m_idle.size());
         }
-        TRC("Connection: init connection num[%lu] success", m_conns.size());
-        return !m_conns.empty();
+        if (m_total == 0) {
+            SYS("Connection: no connection could be opened");
+            return false;
+        }
+        m_keeper = std::thread(&ConnectionPool::keep, this);
+        return true;
     }
 
     void exit() {
+        {
+            // threads outliving the pool must not call back into it
+            std::lock_guard<std::mutex> slg(slots_mutex());
+            std::lock_guard<std::mutex> lg(m_mtx);
+            m_is_stop = true;
+            // pairs with the fence in release(): either it sees the stop
+            // or gather sees what it parked
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            gather(steady_clock_t::duration::min());
+            for (auto slots : m_slots) {
+                slots->pool.store(nullptr, std::memory_order_release);
+            }
+            m_slots.clear();
+        }
+        m_keeper_cv.notify_all();
+        m_cv.notify_all();
+        if (m_keeper.joinable()) {
+            m_keeper.join();
+        }
         std::lock_guard<std::mutex> lg(m_mtx);
-        while (!m_conns.empty()) {
-            auto dba = m_conns.front();
-            dba->exit();
-            m_conns.pop();
+        while (!m_idle.empty()) {
+            destroy(m_idle.back().conn);
+            m_idle.pop_back();
+            --m_total;
         }
     }
 
+    // waits as long as it takes, nullptr only once the pool is exiting.
     T* acquire() {
+        return acquire_until(steady_clock_t::time_point::max());
+    }
+
+    // nullptr on timeout.
+    T* acquire_for(std::chrono::milliseconds timeout) {
+        return acquire_until(steady_clock_t::now() + timeout);
+    }
+
+    // an idle connection or nullptr, never waits. When none is idle the
+    // keeper is asked to open one if the pool may still grow.
+    T* try_acquire() {
+        auto conn = fast_acquire();
+        if (conn) return conn;
+        std::unique_lock<std::mutex> ul(m_mtx);
+        idle_t item;
+        while (take_any(&item)) {
+            ul.unlock();
+            conn = check_out(item);
+            if (conn) return conn;
+            ul.lock();
+        }
+        if (m_total < m_max) {
+            m_want_grow = true;
+            m_keeper_cv.notify_one();
+        }
+        return nullptr;
+    }
+
+    void release(T *dba) {
+        if (!dba) return;
+        if (m_waiters.load(std::memory_order_seq_cst) == 0 && !m_is_stop.load(std::memory_order_relaxed)) {
+            auto now = steady_clock_t::now();
+            idle_t item{dba, now, now};
+            auto parked = false;
+            auto slots = local_slots();
+            for (uint32_t idx = 0; slots && idx < THREAD_CACHE && !parked; ++idx) {
+                if (!slots->conns[idx].load(std::memory_order_relaxed)) {
+                    slots->since[idx].store(item.since.time_since_epoch().count(), std::memory_order_relaxed);
+                    slots->conns[idx].store(dba, std::memory_order_release);
+                    parked = true;
+                }
+            }
+            if (!parked) parked = m_shared.try_put(&item);
+            if (parked) {
+                // a waiter that showed up meanwhile either saw the connection
+                // when it scanned, or gets woken here. Same for exit.
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_is_stop.load(std::memory_order_relaxed)) {
+                    reclaim(slots);
+                    return;
+                }
+                if (m_waiters.load(std::memory_order_relaxed) > 0) {
+                    std::lock_guard<std::mutex> lg(m_mtx);
+                    m_cv.notify_all();
+                }
+                return;
+            }
+        }
+        put_idle(dba);
+    }
+
+private:
+    enum { MAX_INIT_THREADS = 8, THREAD_CACHE = 2, SHARED_RING = 256 };
+
+    typedef struct {
+        T *conn;
+        steady_clock_t::time_point since;       // idle from, for idle_ms
+        steady_clock_t::time_point alive;       // last known alive, for validate_ms
+    } idle_t;
+
+    // connections a thread released, kept for its next acquire. Other
+    // threads may take them (exchange to nullptr) under m_mtx, only the
+    // owner puts them back. pool is cleared by the pool's exit(), under
+    // slots_mutex so a thread ending meanwhile never calls a pool that is gone.
+    struct thread_slots_t {
+        std::atomic<ConnectionPool*> pool{nullptr};
+        std::atomic<T*> conns[THREAD_CACHE];
+        std::atomic<steady_clock_t::rep> since[THREAD_CACHE];
+
+        thread_slots_t() {
+            for (uint32_t idx = 0; idx < THREAD_CACHE; ++idx) {
+                conns[idx].store(nullptr, std::memory_order_relaxed);
+                since[idx].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ~thread_slots_t() {
+            std::lock_guard<std::mutex> slg(slots_mutex());
+            auto owner = pool.load(std::memory_order_acquire);
+            if (owner) owner->leave(this);
+        }
+    };
+
+    // one per T like the slots, taken before m_mtx.
+    static std::mutex &slots_mutex() {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    // the calling thread's slots, nullptr when that thread already caches
+    // for another pool of the same T.
+    thread_slots_t *local_slots() {
+        static thread_local thread_slots_t slots;
+        auto owner = slots.pool.load(std::memory_order_relaxed);
+        if (!owner) {
+            std::lock_guard<std::mutex> lg(m_mtx);
+            if (m_is_stop) return nullptr;
+            owner = this;
+            slots.pool.store(owner, std::memory_order_relaxed);
+            m_slots.push_back(&slots);
+        }
+        return owner == this ? &slots : nullptr;
+    }
+
+    void leave(thread_slots_t *slots) {
+        std::vector<T*> conns;
+        {
+            std::lock_guard<std::mutex> lg(m_mtx);
+            for (size_t idx = 0; idx < m_slots.size(); ++idx) {
+                if (m_slots[idx] == slots) {
+                    m_slots[idx] = m_slots.back();
+                    m_slots.pop_back();
+                    break;
+                }
+            }
+            for (uint32_t idx = 0; idx < THREAD_CACHE; ++idx) {
+                auto conn = slots->conns[idx].exchange(nullptr, std::memory_order_acquire);
+                if (conn) conns.push_back(conn);
+            }
+        }
+        for (auto conn : conns) {
+            put_idle(conn);
+        }
+    }
+
+    // a release that parked a connection after exit() gathered: whatever
+    // is parked now goes, exit may have finished already. slots are the
+    // caller's, exit has dropped them from m_slots.
+    void reclaim(thread_slots_t *slots) {
+        std::vector<T*> conns;
+        {
+            std::lock_guard<std::mutex> lg(m_mtx);
+            gather(steady_clock_t::duration::min());
+            for (auto &&item : m_idle) {
+                conns.push_back(item.conn);
+            }
+            for (uint32_t idx = 0; slots && idx < THREAD_CACHE; ++idx) {
+                auto conn = slots->conns[idx].exchange(nullptr, std::memory_order_acquire);
+                if (conn) conns.push_back(conn);
+            }
+            m_idle.clear();
+            m_total -= (uint32_t) conns.size();
+        }
+        for (auto conn : conns) {
+            destroy(conn);
+        }
+    }
+
+    // own slots, then the shared ring, no lock taken.
+    T* fast_acquire() {
+        auto slots = local_slots();
+        for (uint32_t idx = 0; slots && idx < THREAD_CACHE; ++idx) {
+            auto conn = slots->conns[idx].exchange(nullptr, std::memory_order_acquire);
+            if (conn) {
+                auto since = since_of(slots, idx);
+                idle_t item{conn, since, since};
+                conn = check_out(item);
+                if (conn) return conn;
+            }
+        }
+        idle_t item;
+        while (m_shared.try_get(&item)) {
+            auto conn = check_out(item);
+            if (conn) return conn;
+        }
+        return nullptr;
+    }
+
+    T* acquire_until(steady_clock_t::time_point deadline) {
+        if (m_waiters.load(std::memory_order_relaxed) == 0) {
+            auto conn = fast_acquire();
+            if (conn) return conn;
+        }
         std::unique_lock<std::mutex> ul(m_mtx);
+        T *conn = nullptr;
+        auto waiting = false;
         for (;;) {
-            if (!m_conns.empty()) {
-                auto dba = m_conns.front();
-                m_conns.pop();
+            if (m_is_stop) break;
+            idle_t item;
+            if (take_any(&item)) {
+                ul.unlock();
+                conn = check_out(item);
+                ul.lock();
+                if (conn) break;
+                continue;
+            }
+            if (m_total < m_max) {
+                ++m_total;
                 ul.unlock();
-                return dba;
+                conn = create();
+                ul.lock();
+                if (conn) break;
+                --m_total;
+            }
+            if (!waiting) {
+                // from here on releases come to the mutex path, scan once more
+                waiting = true;
+                m_waiters.fetch_add(1, std::memory_order_seq_cst);
+                continue;
+            }
+            if (deadline == steady_clock_t::time_point::max()) {
+                m_cv.wait(ul);
+            } else if (m_cv.wait_until(ul, deadline) == std::cv_status::timeout && m_idle.empty()) {
+                WRN_RATE_LIMITED(1000, "Connection: acquire timeout");
+                break;
             }
-            WRN("Connection: wait to acquire...");
-            m_cv.wait(ul);
         }
+        if (waiting) m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return conn;
     }
 
-    void release(T *dba) {
+    // under m_mtx: the most recently used idle connection, else one from
+    // the shared ring, else one parked in any thread's slots.
+    bool take_any(idle_t *item) {
+        if (!m_idle.empty()) {
+            *item = m_idle.back();
+            m_idle.pop_back();
+            return true;
+        }
+        if (m_shared.try_get(item)) return true;
+        for (auto slots : m_slots) {
+            for (uint32_t idx = 0; idx < THREAD_CACHE; ++idx) {
+                auto conn = slots->conns[idx].exchange(nullptr, std::memory_order_acquire);
+                if (conn) {
+                    auto since = since_of(slots, idx);
+                    *item = {conn, since, since};
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    static steady_clock_t::time_point since_of(const thread_slots_t *slots, uint32_t idx) {
+        return steady_clock_t::time_point(steady_clock_t::duration(
+            slots->since[idx].load(std::memory_order_relaxed)));
+    }
+
+    // the connection, pinged first if it sat idle for validate_ms. nullptr
+    // if it was dead (and is now closed). Called without m_mtx.
+    T* check_out(const idle_t &item) {
+        if (steady_clock_t::now() - item.alive < std::chrono::milliseconds(m_validate_ms)) {
+            return item.conn;
+        }
+        if (ping(item.conn, 0)) return item.conn;
+        WRN("Connection: drop dead idle connection");
+        destroy(item.conn);
+        std::lock_guard<std::mutex> lg(m_mtx);
+        --m_total;
+        m_keeper_cv.notify_one();
+        return nullptr;
+    }
+
+    void put_idle(T *dba) {
         {
             std::lock_guard<std::mutex> lg(m_mtx);
-            m_conns.push(dba);
+            if (!m_is_stop) {
+                auto now = steady_clock_t::now();
+                m_idle.push_back({dba, now, now});
+                dba = nullptr;
+            } else {
+                --m_total;
+            }
+        }
+        if (dba) {
+            destroy(dba);
+            return;
         }
         m_cv.notify_one();
     }
 
-private:
-    std::queue<T*> m_conns;
+    // under m_mtx: m_idle is kept oldest first by since, so the back is
+    // the most recently used. Usually a push_back.
+    void insert_idle(const idle_t &item) {
+        auto pos = m_idle.end();
+        while (pos != m_idle.begin() && (pos - 1)->since > item.since) --pos;
+        m_idle.insert(pos, item);
+    }
+
+    // under m_mtx: moves the shared ring and thread slots (those idle at
+    // least min_idle) into m_idle, where the keeper and exit can see them.
+    void gather(steady_clock_t::duration min_idle) {
+        idle_t item;
+        while (m_shared.try_get(&item)) {
+            insert_idle(item);
+        }
+        auto now = steady_clock_t::now();
+        for (auto slots : m_slots) {
+            for (uint32_t idx = 0; idx < THREAD_CACHE; ++idx) {
+                if (!slots->conns[idx].load(std::memory_order_relaxed)) continue;
+                if (now - since_of(slots, idx) < min_idle) continue;
+                auto conn = slots->conns[idx].exchange(nullptr, std::memory_order_acquire);
+                auto since = since_of(slots, idx);
+                if (conn) insert_idle({conn, since, since});
+            }
+        }
+    }
+
+    void keep() {
+        std::unique_lock<std::mutex> ul(m_mtx);
+        while (!m_is_stop) {
+            m_keeper_cv.wait_for(ul, std::chrono::milliseconds(m_check_ms));
+            if (m_is_stop) break;
+            gather(std::chrono::milliseconds(m_validate_ms < m_idle_ms ? m_validate_ms : m_idle_ms));
+
+            // close the surplus, take the stale out for a ping
+            auto now = steady_clock_t::now();
+            std::vector<T*> evict;
+            std::vector<idle_t> check;
+            for (auto it = m_idle.begin(); it != m_idle.end();) {
+                if (now - it->since >= std::chrono::milliseconds(m_idle_ms) && m_total - evict.size() > m_min) {
+                    evict.push_back(it->conn);
+                } else if (now - it->alive >= std::chrono::milliseconds(m_validate_ms)) {
+                    check.push_back(*it);
+                } else {
+                    ++it;
+                    continue;
+                }
+                it = m_idle.erase(it);
+            }
+            m_total -= (uint32_t) evict.size();
+            ul.unlock();
+
+            for (auto conn : evict) {
+                destroy(conn);
+            }
+            std::vector<idle_t> alive;
+            uint32_t dead = 0;
+            for (auto &&item : check) {
+                if (ping(item.conn, 0)) {
+                    item.alive = steady_clock_t::now();
+                    alive.push_back(item);
+                } else {
+                    destroy(item.conn);
+                    ++dead;
+                }
+            }
+            if (dead > 0) {
+                WRN("Connection: dropped dead connection num[%u]", dead);
+            }
+
+            // still idle since when they were, only proven alive
+            ul.lock();
+            for (auto &&item : alive) {
+                insert_idle(item);
+            }
+            m_total -= dead;
+            uint32_t need = m_total < m_min ? m_min - m_total : 0;
+            if (need == 0 && m_want_grow && m_total < m_max) need = 1;
+            m_want_grow = false;
+            m_total += need;
+            ul.unlock();
+
+            std::vector<T*> fresh;
+            for (uint32_t idx = 0; idx < need; ++idx) {
+                auto conn = create();
+                if (conn) fresh.push_back(conn);
+            }
+
+            ul.lock();
+            m_total -= need - (uint32_t) fresh.size();
+            now = steady_clock_t::now();
+            for (auto conn : fresh) {
+                m_idle.push_back({conn, now, now});
+            }
+            if (!alive.empty() || !fresh.empty()) {
+                m_cv.notify_all();
+            }
+        }
+    }
+
+    T* create() {
+        auto conn = new PooledConnection<T>;
+        if (!conn->init(&m_info)) {
+            delete conn;
+            return nullptr;
+        }
+        return conn;
+    }
+
+    static void destroy(T *conn) {
+        conn->exit();
+        delete static_cast<PooledConnection<T>*>(conn);
+    }
+
+    // T::ping when T has one, otherwise every connection counts as alive.
+    template <typename C>
+    static auto ping(C *conn, int) -> decltype(conn->ping(), bool()) {
+        return conn->ping();
+    }
+
+    template <typename C>
+    static bool ping(C *, long) {
+        return true;
+    }
+
+    ConnectionInfo m_info{};
+    uint32_t m_min = 0;
+    uint32_t m_max = 0;
+    uint32_t m_total = 0;       // idle + in use + being opened
+    uint32_t m_validate_ms = 30000;
+    uint32_t m_idle_ms = 300000;
+    uint32_t m_check_ms = 1000;
+    std::atomic<bool> m_is_stop{false};
+    bool m_want_grow = false;
+    std::atomic<uint32_t> m_waiters{0};
+    std::deque<idle_t> m_idle;
+    MPMCQueue<idle_t, SHARED_RING> m_shared;
+    std::vector<thread_slots_t*> m_slots;
     std::mutex m_mtx;
     std::condition_variable m_cv;
+    std::condition_variable m_keeper_cv;
+    std::thread m_keeper;
 };
 
 template <typename T>
@@ -76,17 +587,99 @@ public:
         m_dba = m_pool->acquire();
     }
 
+    // check valid() before use, false when no connection came in time.
+    explicit ConnectionAdapter(std::chrono::milliseconds timeout) {
+        m_pool = &Singleton<ConnectionPool<T>>::instance();
+        m_dba = m_pool->acquire_for(timeout);
+    }
+
     ~ConnectionAdapter() {
+        if (!m_batch.empty()) {
+            WRN("Connection: drop [%lu] queued statements never run", m_batch.size());
+        }
         m_pool->release(m_dba);
     }
 
+    bool valid() const {
+        return m_dba != nullptr;
+    }
+
     T& set_sql(const std::string &sql) {
         return m_dba->set_sql(sql);
     }
 
+    T *operator->() {
+        return m_dba;
+    }
+
+    // statements held back until run_batch sends them together.
+    ConnectionAdapter &queue(const std::string &sql) {
+        m_batch.push_back(sql);
+        return *this;
+    }
+
+    size_t queued() const {
+        return m_batch.size();
+    }
+
+    // one round trip through T::execute_batch when T has it, otherwise
+    // T::execute per statement, stopping at the first failure. The queue
+    // is empty afterwards either way.
+    bool run_batch() {
+        if (m_batch.empty()) return true;
+        auto ret = execute_batch(m_dba, 0);
+        m_batch.clear();
+        return ret;
+    }
+
+    // T::prepare once per connection and SQL text, later calls on the same
+    // pooled connection get the cached handle back. A failed prepare (a
+    // handle that tests false) is returned but not cached.
+    template <typename C = T>
+    auto prepare(const std::string &sql) -> decltype(std::declval<C&>().prepare(sql)) {
+        auto &stmts = static_cast<PooledConnection<T>*>(m_dba)->stmts;
+        auto iter = stmts.find(sql);
+        if (iter != stmts.end()) return iter->second;
+        auto stmt = m_dba->prepare(sql);
+        if (valid_handle(stmt)) stmts.emplace(sql, stmt);
+        return stmt;
+    }
+
 private:
+    template <typename C>
+    auto execute_batch(C *conn, int) -> decltype(conn->execute_batch(std::vector<std::string>()), bool()) {
+        return conn->execute_batch(m_batch);
+    }
+
+    template <typename C>
+    auto execute_batch(C *conn, long) -> decltype(conn->execute(std::string()), bool()) {
+        for (auto &&sql : m_batch) {
+            if (!conn->execute(sql)) {
+                WRN("Connection: batch stopped at [%s]", sql.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename C>
+    bool execute_batch(C *, ...) {
+        static_assert(sizeof(C) == 0, "run_batch needs T::execute_batch or T::execute");
+        return false;
+    }
+
+    template <typename H>
+    static bool valid_handle(const H &stmt) {
+        if constexpr (std::is_constructible<bool, const H&>::value) {
+            return (bool) stmt;
+        } else {
+            return true;
+        }
+    }
+
     ConnectionPool<T> *m_pool = nullptr;
     T *m_dba = nullptr;
+    std::vector<std::string> m_batch;
 };
 
 #endif  // UTIL_CONNECTION_H
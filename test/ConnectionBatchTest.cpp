@@ -0,0 +1,150 @@
+//
+// ConnectionAdapter::run_batch and prepare against fake backends that
+// charge a round trip of latency per call and record what they ran.
+//
+//   g++ -std=c++17 -O1 -g -fsanitize=address -pthread -I. -Isql -Iutil -Ipattern
+//       test/ConnectionBatchTest.cpp -o batch_test && ./batch_test
+//
+
+#include "Connection.h"
+
+#include <cassert>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+
+enum { RTT_US = 2000, STATEMENTS = 20 };
+
+static void round_trip() {
+    std::this_thread::sleep_for(std::chrono::microseconds(RTT_US));
+}
+
+// the statements it ran, one round trip per call.
+struct FakeBase {
+    bool init(ConnectionInfo*) {
+        return true;
+    }
+
+    void exit() {}
+
+    FakeBase &set_sql(const std::string &) {
+        return *this;
+    }
+
+    bool execute(const std::string &sql) {
+        round_trip();
+        ++round_trips;
+        if (sql == "fail") return false;
+        ran.push_back(sql);
+        return true;
+    }
+
+    std::vector<std::string> ran;
+    uint32_t round_trips = 0;
+};
+
+struct BatchDB : FakeBase {
+    bool execute_batch(const std::vector<std::string> &sqls) {
+        round_trip();
+        ++round_trips;
+        ran.insert(ran.end(), sqls.begin(), sqls.end());
+        return true;
+    }
+
+    // nullptr for SQL it can not parse.
+    const char *prepare(const std::string &sql) {
+        ++prepares;
+        if (sql == "bad") return nullptr;
+        return "stmt";
+    }
+
+    uint32_t prepares = 0;
+};
+
+struct PlainDB : FakeBase {};
+
+template <typename T>
+static double run(ConnectionAdapter<T> &conn, std::vector<std::string> *ran, uint32_t *trips) {
+    for (uint32_t idx = 0; idx < STATEMENTS; ++idx) {
+        conn.queue("insert " + std::to_string(idx));
+    }
+    assert(conn.queued() == STATEMENTS);
+    auto start = std::chrono::steady_clock::now();
+    auto ok = conn.run_batch();
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    assert(ok);
+    assert(conn.queued() == 0);
+    (void) ok;
+    *ran = conn->ran;
+    *trips = conn->round_trips;
+    return ms;
+}
+
+int main() {
+    ConnectionInfo info;
+    auto &batch_pool = Singleton<ConnectionPool<BatchDB>>::instance();
+    auto &plain_pool = Singleton<ConnectionPool<PlainDB>>::instance();
+    auto batch_ok = batch_pool.init(&info, 1);
+    auto plain_ok = plain_pool.init(&info, 1);
+    if (!batch_ok || !plain_ok) {
+        puts("pool init failed");
+        return 1;
+    }
+
+    std::vector<std::string> expect;
+    for (uint32_t idx = 0; idx < STATEMENTS; ++idx) {
+        expect.push_back("insert " + std::to_string(idx));
+    }
+
+    std::vector<std::string> ran;
+    uint32_t trips;
+    double batch_ms, plain_ms;
+    {
+        ConnectionAdapter<BatchDB> conn;
+        batch_ms = run(conn, &ran, &trips);
+        assert(ran == expect);
+        assert(trips == 1);
+    }
+    {
+        ConnectionAdapter<PlainDB> conn;
+        plain_ms = run(conn, &ran, &trips);
+        assert(ran == expect);
+        assert(trips == STATEMENTS);
+
+        // stops at the first failure, the rest never runs
+        conn->ran.clear();
+        conn.queue("a").queue("fail").queue("b");
+        auto ok = conn.run_batch();
+        assert(!ok);
+        assert(conn.queued() == 0);
+        (void) ok;
+        assert(conn->ran == std::vector<std::string>{"a"});
+    }
+    printf("%d statements: batched %.1f ms in 1 round trip, one by one %.1f ms in %d\n",
+           STATEMENTS, batch_ms, plain_ms, STATEMENTS);
+    assert(batch_ms * 4 < plain_ms);
+
+    {
+        ConnectionAdapter<BatchDB> conn;
+        auto base = conn->prepares;
+        auto first = conn.prepare("select 1");
+        auto again = conn.prepare("select 1");
+        assert(first && again);
+        assert(conn->prepares == base + 1);
+        // failures are not cached, a later attempt prepares again
+        first = conn.prepare("bad");
+        again = conn.prepare("bad");
+        assert(!first && !again);
+        assert(conn->prepares == base + 3);
+        (void) base;
+        (void) first;
+        (void) again;
+    }
+
+    batch_pool.exit();
+    plain_pool.exit();
+    puts("ok");
+    return 0;
+}
@@ -2,12 +2,21 @@
 #define UTILS_TYPECONVERTER_H
 
 #include <sstream>
+#include <charconv>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
 
+// str2num/num2str go through streams: any type with operator>>/<<, but a
+// locale lookup and an allocation per call. parse/format and the fixed
+// point pair below are the allocation-free path for message fields.
 class TypeConverter {
 public:
+    enum { MAX_SCALE = 18 };
+
     template <typename T>
     static T str2num(const std::string &str) {
-        T result;
+        T result{};
         std::istringstream iss(str);
         iss >> result;
         return result;
@@ -19,6 +28,121 @@ public:
         oss << num;
         return oss.str();
     }
+
+    // the whole of [first, last) as an integer or floating point T. False
+    // on an empty range, trailing junk or out of range, *num is left as is.
+    // A single leading '+' is taken like str2num does, from_chars alone
+    // would refuse it.
+    template <typename T>
+    static bool parse(const char *first, const char *last, T *num) {
+        if (first != last && *first == '+') {
+            ++first;
+            if (first != last && *first == '-') return false;
+        }
+        if (first == last) return false;
+        T val;
+        auto ret = std::from_chars(first, last, val);
+        if (ret.ec != std::errc() || ret.ptr != last) return false;
+        *num = val;
+        return true;
+    }
+
+    template <typename T>
+    static bool parse(std::string_view str, T *num) {
+        return parse(str.data(), str.data() + str.size(), num);
+    }
+
+    // num into buf without a terminator, returns the length, 0 when it
+    // does not fit. Floating point gets the shortest exact form.
+    template <typename T>
+    static size_t format(char *buf, size_t size, T num) {
+        auto ret = std::to_chars(buf, buf + size, num);
+        if (ret.ec != std::errc()) return 0;
+        return ret.ptr - buf;
+    }
+
+    // "-12.34" with scale 4 is -123400. At most scale fraction digits,
+    // more are only accepted when zero, so a price never gets rounded.
+    static bool parse_fixed(const char *first, const char *last, uint32_t scale, int64_t *num) {
+        if (scale > MAX_SCALE || first == last) return false;
+        bool neg = false;
+        if (*first == '-' || *first == '+') {
+            neg = *first == '-';
+            ++first;
+        }
+        uint64_t val = 0;
+        uint32_t digits = 0;
+        uint32_t frac = 0;
+        bool dot = false;
+        for (auto pos = first; pos != last; ++pos) {
+            auto ch = *pos;
+            if (ch == '.' && !dot) {
+                dot = true;
+                continue;
+            }
+            if (ch < '0' || ch > '9') return false;
+            ++digits;
+            if (dot) {
+                if (frac == scale) {
+                    if (ch != '0') return false;
+                    continue;
+                }
+                ++frac;
+            }
+            if (__builtin_mul_overflow(val, 10, &val) || __builtin_add_overflow(val, (uint64_t) (ch - '0'), &val)) {
+                return false;
+            }
+        }
+        if (digits == 0) return false;
+        if (__builtin_mul_overflow(val, pow10(scale - frac), &val)) return false;
+        uint64_t limit = neg ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+        if (val > limit) return false;
+        *num = neg ? (int64_t) (0 - val) : (int64_t) val;
+        return true;
+    }
+
+    static bool parse_fixed(std::string_view str, uint32_t scale, int64_t *num) {
+        return parse_fixed(str.data(), str.data() + str.size(), scale, num);
+    }
+
+    // inverse of parse_fixed, always scale fraction digits. Returns the
+    // length, 0 when it does not fit.
+    static size_t format_fixed(char *buf, size_t size, int64_t num, uint32_t scale) {
+        if (scale > MAX_SCALE) return 0;
+        char tmp[48];
+        size_t len = 0;
+        uint64_t val = num;
+        if (num < 0) {
+            tmp[len++] = '-';
+            val = 0 - val;
+        }
+        auto div = pow10(scale);
+        auto ret = std::to_chars(tmp + len, tmp + sizeof(tmp), val / div);
+        len = ret.ptr - tmp;
+        if (scale > 0) {
+            tmp[len++] = '.';
+            auto rem = val % div;
+            for (auto idx = scale; idx > 0; --idx) {
+                tmp[len + idx - 1] = (char) ('0' + rem % 10);
+                rem /= 10;
+            }
+            len += scale;
+        }
+        if (len > size) return 0;
+        memcpy(buf, tmp, len);
+        return len;
+    }
+
+private:
+    static uint64_t pow10(uint32_t exp) {
+        static const uint64_t table[MAX_SCALE + 1] = {
+            1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+            100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+            10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+            100000000000000000ull, 1000000000000000000ull
+        };
+        return table[exp];
+    }
 };
 
 #endif
@@ -1,14 +1,43 @@
+#ifndef UTILS_LOG_STD_H
+#define UTILS_LOG_STD_H
+
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <cstdarg>
 #include <cstdio>
+#include <ctime>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <type_traits>
 
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// "[date time.usec][file:line][tid][lvl]: " into buf, returns its length.
+// *sec and *time_ds cache the broken down time of the last second seen.
+inline int log_head(char *buf, size_t size, const struct timeval &tv, time_t *sec, struct tm *time_ds,
+                    long tid, const char *lvl, const char *file, int line) {
+    if (tv.tv_sec != *sec) {
+        *sec = tv.tv_sec;
+        localtime_r(sec, time_ds);
+    }
+    auto len = snprintf(buf, size,
+                        "[%04d-%02d-%02d %02d:%02d:%02d.%06lu][%20s:%04d][%06lu][%3s]: ",
+                        time_ds->tm_year + 1900, time_ds->tm_mon + 1, time_ds->tm_mday,
+                        time_ds->tm_hour, time_ds->tm_min, time_ds->tm_sec, (unsigned long) tv.tv_usec,
+                        basename(file), line, tid, lvl);
+    return len < (int) size ? len : (int) size - 1;
+}
+
 __attribute__((format(printf, 4, 5)))
 inline void LOG(const char *lvl, const char *file, int line, const char *fmt, ...);
 
@@ -25,24 +54,683 @@ inline void LOG(const char *lvl, const char *file, int line, const char *fmt, ..
     if (tid == 0) {
         tid = syscall(__NR_gettid);
     }
-    if (tv.tv_sec != cur_sec) {
-        localtime_r(&cur_sec, &time_ds);
-    }
-    snprintf(msg_buf, 1024,
-             "[%04d-%02d-%02d %02d:%02d:%02d.%06lu][%20s:%04d][%06lu][%3s]: ",
-             time_ds.tm_year + 1900, time_ds.tm_mon + 1, time_ds.tm_mday,
-             time_ds.tm_hour, time_ds.tm_min, time_ds.tm_sec, tv.tv_usec,
-             basename(file), line, tid, lvl);
+    auto len = log_head(msg_buf, sizeof(msg_buf), tv, &cur_sec, &time_ds, tid, lvl, file, line);
 
     va_list args;
     va_start(args, fmt);
-    vsnprintf(msg_buf + 70, 954, fmt, args);
+    vsnprintf(msg_buf + len, sizeof(msg_buf) - len, fmt, args);
     va_end(args);
     printf("%s\n", msg_buf);
 }
 
-#define INF(fmt, ...) LOG("INF", __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define TRC(fmt, ...) LOG("TRC", __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define WRN(fmt, ...) LOG("WRN", __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define ERR(fmt, ...) LOG("ERR", __FILE__, __LINE__, fmt, ##__VA_ARGS__)
-#define DIE(fmt, ...) LOG("DIE", __FILE__, __LINE__, fmt, ##__VA_ARGS__), exit(errno)
+enum {
+    LOG_BLOCK,      // caller waits for the backend to make room
+    LOG_DROP,       // record is lost
+    LOG_COUNT       // record is lost, the backend logs how many were
+};
+
+// Asynchronous backend behind the log macros once start() is called.
+// A caller copies the format pointer, a TSC timestamp and its raw arguments
+// (strings by value) into its own thread's SPSC byte ring and returns; no
+// lock, no formatting, no syscall. One backend thread drains every ring,
+// formats with the same layout as LOG and writes in batches. Format strings,
+// levels and file names must be literals, which the macros guarantee.
+// Timestamps assume an invariant TSC, as on any x86 of the last decade.
+class AsyncLog {
+public:
+    enum {
+        RING_SIZE = 1 << 20,        // bytes per thread
+        MAX_STR = 1024,             // longer %s arguments are cut
+        MAX_LINE = 4096,
+        OUT_SIZE = 64 * 1024
+    };
+
+    static AsyncLog &instance() {
+        static AsyncLog alog;
+        return alog;
+    }
+
+    // checked by the macros on every call.
+    static std::atomic<bool> &enabled() {
+        static std::atomic<bool> on{false};
+        return on;
+    }
+
+    // path nullptr or "-" is stdout. Rings of threads that logged before
+    // keep their size, new ones get ring_size (rounded up to a power of 2).
+    bool start(const char *path=nullptr, int policy=LOG_BLOCK,
+               uint32_t ring_size=RING_SIZE, uint32_t flush_us=1000) {
+        if (enabled().load(std::memory_order_acquire)) return true;
+        if (!path || strcmp(path, "-") == 0) {
+            m_fp = stdout;
+        } else {
+            m_fp = fopen(path, "a");
+            if (!m_fp) {
+                LOG("ERR", __FILE__, __LINE__, "open log file[%s] error[%d]", path, errno);
+                return false;
+            }
+        }
+        m_policy = policy;
+        m_ring_size = 4096;
+        while (m_ring_size < ring_size) m_ring_size <<= 1;
+        m_flush_us = flush_us;
+
+        // first guess of the TSC rate, refined from then on by the backend.
+        // Against the monotonic clock, so NTP steps can not skew the rate;
+        // the wall clock only gives the offset, once.
+        m_tsc0 = tsc();
+        m_ns0 = mono_ns();
+        m_wall_off = wall_ns() - m_ns0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        m_ticks_per_ns = (double) (tsc() - m_tsc0) / (double) (mono_ns() - m_ns0);
+
+        m_stop.store(false, std::memory_order_relaxed);
+        m_thrd = std::thread(&AsyncLog::run, this);
+        enabled().store(true, std::memory_order_release);
+        return true;
+    }
+
+    // writes out everything queued and goes back to synchronous LOG. Records
+    // pushed while stop runs may wait in their ring until the next start.
+    void stop() {
+        if (!enabled().exchange(false)) return;
+        m_stop.store(true, std::memory_order_release);
+        if (m_thrd.joinable()) {
+            m_thrd.join();
+        }
+        if (m_fp && m_fp != stdout) {
+            fclose(m_fp);
+        }
+        m_fp = nullptr;
+    }
+
+    // false when the calling thread is past its ring, in thread_local
+    // destructors that run after it went; LOG it synchronously then.
+    template <typename... ARGS>
+    bool push(const char *lvl, const char *file, int line, const char *fmt, const ARGS&... args) {
+        auto ring = local_ring();
+        if (!ring) return false;
+        uint32_t size = sizeof(rec_t);
+        ((size += arg_size(args)), ...);
+        size = (size + 7) & ~7u;
+        if (size > ring->size / 2) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        uint64_t next;
+        char *pos;
+        while (!(pos = ring->alloc(size, next))) {
+            if (m_policy != LOG_BLOCK || !enabled().load(std::memory_order_relaxed)) {
+                if (m_policy != LOG_DROP) ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            std::this_thread::yield();
+        }
+        auto rec = (rec_t*) pos;
+        rec->size = size;
+        rec->line = (uint32_t) line;
+        rec->lvl = lvl;
+        rec->file = file;
+        rec->fmt = fmt;
+        rec->tsc = tsc();
+        pos += sizeof(rec_t);
+        (encode(pos, args), ...);
+        memset(pos, 0, (char*) rec + size - pos);
+        ring->tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    ~AsyncLog() {
+        stop();
+        // rings of threads still alive are left to the process exit
+        for (auto ring : m_rings) {
+            if (ring->retired.load(std::memory_order_acquire)) delete ring;
+        }
+    }
+
+private:
+    enum {
+        PAD_LINE = 0xFFFFFFFF       // filler up to the end of the ring
+    };
+
+    enum {
+        ARG_SINT = 1,               // 0 is the padding after the last one
+        ARG_UINT,
+        ARG_DBL,
+        ARG_PTR,
+        ARG_STR
+    };
+
+    typedef struct {
+        uint32_t size;              // whole record, a multiple of 8
+        uint32_t line;
+        const char *lvl;
+        const char *file;
+        const char *fmt;
+        uint64_t tsc;
+    } rec_t;
+
+    typedef struct {
+        int kind;
+        int size;                   // of the integer type passed
+        uint64_t bits;
+        double dbl;
+        const char *str;
+    } arg_t;
+
+    struct ring_t {
+        explicit ring_t(uint32_t cap) : size(cap), buf(new char[cap]) {}
+
+        ~ring_t() {
+            delete[] buf;
+        }
+
+        // room for len contiguous bytes, or nullptr when full. Publish
+        // with tail = next.
+        char *alloc(uint32_t len, uint64_t &next) {
+            auto seq = tail.load(std::memory_order_relaxed);
+            auto pos = (uint32_t) (seq & (size - 1));
+            auto room = size - pos;
+            auto need = len <= room ? len : room + len;
+            if (seq + need > head_cache + size) {
+                head_cache = head.load(std::memory_order_acquire);
+                if (seq + need > head_cache + size) return nullptr;
+            }
+            if (len > room) {
+                uint32_t pad[2] = {room, PAD_LINE};
+                memcpy(buf + pos, pad, sizeof(pad));
+                pos = 0;
+            }
+            next = seq + need;
+            return buf + pos;
+        }
+
+        alignas(64) std::atomic<uint64_t> tail{0};
+        uint64_t head_cache = 0;
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> dropped{0};
+        std::atomic<bool> retired{false};
+        long tid = 0;
+        uint32_t size;
+        char *buf;
+    };
+
+    struct ring_holder_t {
+        ring_t *ring = nullptr;
+
+        ~ring_holder_t() {
+            ring_gone() = true;
+            if (ring) ring->retired.store(true, std::memory_order_release);
+            ring = nullptr;
+        }
+    };
+
+    // trivially destructible, so still readable after the holder is gone.
+    static bool &ring_gone() {
+        static thread_local bool gone = false;
+        return gone;
+    }
+
+    // nullptr once the thread's holder has been destroyed.
+    ring_t *local_ring() {
+        if (ring_gone()) return nullptr;
+        static thread_local ring_holder_t holder;
+        if (!holder.ring) {
+            auto ring = new ring_t(m_ring_size);
+            ring->tid = syscall(__NR_gettid);
+            std::lock_guard<std::mutex> lg(m_mtx);
+            m_rings.push_back(ring);
+            holder.ring = ring;
+        }
+        return holder.ring;
+    }
+
+    static uint64_t tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+    }
+
+    static int64_t wall_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    static int64_t mono_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+    }
+
+    template <typename T>
+    static uint32_t arg_size(const T &arg) {
+        typedef typename std::decay<T>::type arg_type;
+        if constexpr (std::is_same<arg_type, char*>::value || std::is_same<arg_type, const char*>::value) {
+            return 1 + sizeof(uint64_t) + sizeof(uint32_t) + str_len(arg) + 1;
+        } else if constexpr (std::is_floating_point<arg_type>::value) {
+            return 1 + sizeof(double);
+        } else {
+            static_assert(std::is_integral<arg_type>::value || std::is_enum<arg_type>::value
+                          || std::is_pointer<arg_type>::value
+                          || std::is_same<arg_type, std::nullptr_t>::value, "log argument type");
+            return 1 + sizeof(uint64_t);
+        }
+    }
+
+    static uint32_t str_len(const char *str) {
+        if (!str) return 6;
+        auto len = strnlen(str, MAX_STR);
+        return (uint32_t) len;
+    }
+
+    template <typename T>
+    static void encode(char *&pos, const T &arg) {
+        typedef typename std::decay<T>::type arg_type;
+        uint64_t bits;
+        if constexpr (std::is_same<arg_type, char*>::value || std::is_same<arg_type, const char*>::value) {
+            const char *str = arg;
+            uint32_t len = str_len(str);
+            *pos++ = ARG_STR;
+            bits = (uintptr_t) str;
+            memcpy(pos, &bits, sizeof(bits));
+            pos += sizeof(bits);
+            memcpy(pos, &len, sizeof(len));
+            pos += sizeof(len);
+            memcpy(pos, str ? str : "(null)", len);
+            pos += len;
+            *pos++ = '\0';
+            return;
+        } else if constexpr (std::is_floating_point<arg_type>::value) {
+            double dbl = arg;
+            *pos++ = ARG_DBL;
+            memcpy(pos, &dbl, sizeof(dbl));
+            pos += sizeof(dbl);
+            return;
+        } else if constexpr (std::is_pointer<arg_type>::value || std::is_same<arg_type, std::nullptr_t>::value) {
+            *pos++ = ARG_PTR;
+            bits = (uintptr_t) (const void*) arg;
+        } else if constexpr (std::is_enum<arg_type>::value) {
+            encode(pos, (typename std::underlying_type<arg_type>::type) arg);
+            return;
+        } else if constexpr (std::is_signed<arg_type>::value) {
+            *pos++ = (char) (ARG_SINT | sizeof(arg_type) << 4);
+            bits = (uint64_t) (int64_t) arg;
+        } else {
+            *pos++ = (char) (ARG_UINT | sizeof(arg_type) << 4);
+            bits = (uint64_t) arg;
+        }
+        memcpy(pos, &bits, sizeof(bits));
+        pos += sizeof(bits);
+    }
+
+    static bool decode(const char *&pos, const char *end, arg_t *arg) {
+        if (pos >= end || *pos == 0) return false;
+        auto tag = (unsigned char) *pos++;
+        arg->kind = tag & 0xF;
+        arg->size = tag >> 4;
+        if (arg->kind == ARG_DBL) {
+            memcpy(&arg->dbl, pos, sizeof(arg->dbl));
+            pos += sizeof(arg->dbl);
+            return true;
+        }
+        memcpy(&arg->bits, pos, sizeof(arg->bits));
+        pos += sizeof(arg->bits);
+        if (arg->kind == ARG_STR) {
+            uint32_t len;
+            memcpy(&len, pos, sizeof(len));
+            pos += sizeof(len);
+            arg->str = pos;
+            pos += len + 1;
+        }
+        return true;
+    }
+
+    // encode stores signed integers sign-extended and unsigned ones
+    // zero-extended, so the bits are already the value.
+    static int64_t as_signed(const arg_t &arg) {
+        if (arg.kind == ARG_DBL) return (int64_t) arg.dbl;
+        return (int64_t) arg.bits;
+    }
+
+    // what %u/%x of the original type would have printed.
+    static uint64_t as_unsigned(const arg_t &arg) {
+        if (arg.kind == ARG_DBL) return (uint64_t) arg.dbl;
+        if ((arg.kind == ARG_SINT || arg.kind == ARG_UINT) && arg.size < 8) {
+            return arg.bits & ((1ull << arg.size * 8) - 1);
+        }
+        return arg.bits;
+    }
+
+    // printf of fmt over the recorded arguments, one conversion at a time
+    // with the length modifier replaced to match the recorded width.
+    static int format(char *out, int cap, const char *fmt, const char *pos, const char *end) {
+        int len = 0;
+        auto put = [&](int ret) {
+            if (ret > 0) len = len + ret < cap ? len + ret : cap - 1;
+        };
+        while (*fmt && len < cap - 1) {
+            if (*fmt != '%') {
+                out[len++] = *fmt++;
+                continue;
+            }
+            if (fmt[1] == '%') {
+                out[len++] = '%';
+                fmt += 2;
+                continue;
+            }
+            auto start = fmt++;
+            char spec[48];
+            int spec_len = 0;
+            spec[spec_len++] = '%';
+            arg_t arg{};
+            while (*fmt && strchr("-+ #0'", *fmt) && spec_len < 8) spec[spec_len++] = *fmt++;
+            for (int part = 0; part < 2; ++part) {
+                if (part == 1) {
+                    if (*fmt != '.') break;
+                    spec[spec_len++] = *fmt++;
+                }
+                if (*fmt == '*') {
+                    ++fmt;
+                    auto val = decode(pos, end, &arg) ? (int) as_signed(arg) : 0;
+                    spec_len += snprintf(spec + spec_len, 12, "%d", val);
+                } else {
+                    while (*fmt >= '0' && *fmt <= '9' && spec_len < 32) spec[spec_len++] = *fmt++;
+                }
+            }
+            while (*fmt && strchr("hlLqjzt", *fmt)) ++fmt;
+            auto conv = *fmt;
+            if (!conv) break;
+            ++fmt;
+            if (conv == 'n') continue;
+            if (!decode(pos, end, &arg)) {
+                // fewer arguments than conversions, keep the text as is
+                while (start < fmt && len < cap - 1) out[len++] = *start++;
+                continue;
+            }
+            if (strchr("di", conv) && arg.kind == ARG_UINT) {
+                // unsigned under %d keeps its value, also past INT64_MAX
+                memcpy(spec + spec_len, "llu", 4);
+                put(snprintf(out + len, cap - len, spec, (unsigned long long) arg.bits));
+            } else if (strchr("di", conv)) {
+                memcpy(spec + spec_len, "lld", 4);
+                put(snprintf(out + len, cap - len, spec, (long long) as_signed(arg)));
+            } else if (strchr("uoxX", conv)) {
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = conv;
+                spec[spec_len] = '\0';
+                put(snprintf(out + len, cap - len, spec, (unsigned long long) as_unsigned(arg)));
+            } else if (strchr("eEfFgGaA", conv)) {
+                spec[spec_len++] = conv;
+                spec[spec_len] = '\0';
+                auto dbl = arg.kind == ARG_DBL ? arg.dbl : (double) as_signed(arg);
+                put(snprintf(out + len, cap - len, spec, dbl));
+            } else if (conv == 'c') {
+                memcpy(spec + spec_len, "c", 2);
+                put(snprintf(out + len, cap - len, spec, (int) as_signed(arg)));
+            } else if (conv == 's') {
+                memcpy(spec + spec_len, "s", 2);
+                put(snprintf(out + len, cap - len, spec, arg.kind == ARG_STR ? arg.str : "(?)"));
+            } else {
+                memcpy(spec + spec_len, "p", 2);
+                put(snprintf(out + len, cap - len, spec, (void*) (uintptr_t) arg.bits));
+            }
+        }
+        out[len] = '\0';
+        return len;
+    }
+
+    void emit(const struct timeval &tv, long tid, const char *lvl, const char *file, int line,
+              const char *fmt, const char *args, const char *end) {
+        if (m_out.size() + MAX_LINE > OUT_SIZE) flush();
+        auto pos = m_out.size();
+        m_out.resize(pos + MAX_LINE);
+        auto buf = &m_out[pos];
+        auto len = log_head(buf, MAX_LINE, tv, &m_cur_sec, &m_time_ds, tid, lvl, file, line);
+        len += format(buf + len, MAX_LINE - len - 1, fmt, args, end);
+        buf[len++] = '\n';
+        m_out.resize(pos + len);
+    }
+
+    void flush() {
+        if (m_out.empty()) return;
+        fwrite(m_out.data(), 1, m_out.size(), m_fp);
+        m_out.clear();
+    }
+
+    struct timeval to_timeval(uint64_t rec_tsc) {
+        auto ns = m_wall_off + m_ns0 + (int64_t) ((double) (int64_t) (rec_tsc - m_tsc0) / m_ticks_per_ns);
+        struct timeval tv;
+        tv.tv_sec = (time_t) (ns / 1000000000);
+        tv.tv_usec = (suseconds_t) (ns % 1000000000 / 1000);
+        return tv;
+    }
+
+    size_t drain(ring_t *ring) {
+        size_t count = 0;
+        auto seq = ring->head.load(std::memory_order_relaxed);
+        auto end = ring->tail.load(std::memory_order_acquire);
+        while (seq < end) {
+            auto pos = ring->buf + (seq & (ring->size - 1));
+            uint32_t hdr[2];
+            memcpy(hdr, pos, sizeof(hdr));
+            if (hdr[1] != PAD_LINE) {
+                auto rec = (const rec_t*) pos;
+                emit(to_timeval(rec->tsc), ring->tid, rec->lvl, rec->file, (int) rec->line,
+                     rec->fmt, pos + sizeof(rec_t), pos + rec->size);
+                ++count;
+            }
+            seq += hdr[0];
+            ring->head.store(seq, std::memory_order_release);
+        }
+        auto lost = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0 && m_policy != LOG_DROP) {
+            struct timeval tv;
+            gettimeofday(&tv, nullptr);
+            char buf[MAX_LINE];
+            auto len = log_head(buf, sizeof(buf), tv, &m_cur_sec, &m_time_ds, ring->tid, "WRN", __FILE__, __LINE__);
+            snprintf(buf + len, sizeof(buf) - len, "AsyncLog: dropped [%lu] records", (unsigned long) lost);
+            if (m_out.size() + MAX_LINE > OUT_SIZE) flush();
+            m_out.insert(m_out.end(), buf, buf + strlen(buf));
+            m_out.push_back('\n');
+        }
+        return count;
+    }
+
+    void run() {
+        std::vector<ring_t*> rings;
+        m_out.reserve(OUT_SIZE);
+        for (;;) {
+            // read first: the last pass then sees everything pushed before stop
+            auto stopping = m_stop.load(std::memory_order_acquire);
+            auto now_tsc = tsc();
+            auto now_ns = mono_ns();
+            if (now_ns > m_ns0 + 100000000) {
+                m_ticks_per_ns = (double) (now_tsc - m_tsc0) / (double) (now_ns - m_ns0);
+            }
+
+            size_t count = 0;
+            {
+                std::lock_guard<std::mutex> lg(m_mtx);
+                // retired is set after the thread's last push
+                for (size_t idx = 0; idx < m_rings.size();) {
+                    auto ring = m_rings[idx];
+                    if (ring->retired.load(std::memory_order_acquire)) {
+                        count += drain(ring);
+                        delete ring;
+                        m_rings[idx] = m_rings.back();
+                        m_rings.pop_back();
+                    } else {
+                        ++idx;
+                    }
+                }
+                rings = m_rings;
+            }
+            for (auto ring : rings) {
+                count += drain(ring);
+            }
+            flush();
+            fflush(m_fp);
+            if (stopping) break;
+            if (count == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(m_flush_us));
+            }
+        }
+    }
+
+    int m_policy = LOG_BLOCK;
+    uint32_t m_ring_size = RING_SIZE;
+    uint32_t m_flush_us = 1000;
+    FILE *m_fp = nullptr;
+    uint64_t m_tsc0 = 0;
+    int64_t m_ns0 = 0;              // CLOCK_MONOTONIC at m_tsc0
+    int64_t m_wall_off = 0;         // CLOCK_REALTIME - CLOCK_MONOTONIC at start
+    double m_ticks_per_ns = 1.0;
+    time_t m_cur_sec = 0;
+    struct tm m_time_ds{};
+    std::vector<char> m_out;
+    std::atomic<bool> m_stop{false};
+    std::mutex m_mtx;
+    std::vector<ring_t*> m_rings;
+    std::thread m_thrd;
+};
+
+// DIE writes out the async backlog before exiting.
+inline void log_exit(int code) {
+    AsyncLog::instance().stop();
+    exit(code);
+}
+
+#define LOG_LVL_TRC 0
+#define LOG_LVL_INF 1
+#define LOG_LVL_WRN 2
+#define LOG_LVL_SYS 3       // failed system and library calls
+#define LOG_LVL_ERR 4
+#define LOG_LVL_DIE 5
+
+// calls below LOG_MIN_LEVEL are not compiled at all, arguments included.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LVL_TRC
+#endif
+
+// runtime threshold on top of LOG_MIN_LEVEL, one relaxed load per call.
+inline std::atomic<int> &log_level() {
+    static std::atomic<int> lvl{LOG_LVL_TRC};
+    return lvl;
+}
+
+inline void log_set_level(int lvl) {
+    log_level().store(lvl, std::memory_order_relaxed);
+}
+
+inline int64_t log_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// true for the call that should log when at most one per ms may, the
+// calls let through in between are added to *skipped.
+inline bool log_rate_ok(std::atomic<int64_t> *next, std::atomic<uint64_t> *skipped, int64_t ms) {
+    auto now = log_now_ms();
+    auto due = next->load(std::memory_order_relaxed);
+    if (now >= due && next->compare_exchange_strong(due, now + ms, std::memory_order_relaxed)) {
+        return true;
+    }
+    skipped->fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+#define LOG_AT(lvl, fmt, ...) \
+    ((AsyncLog::enabled().load(std::memory_order_relaxed) \
+      && AsyncLog::instance().push(lvl, __FILE__, __LINE__, fmt, ##__VA_ARGS__)) \
+        ? (void) 0 : LOG(lvl, __FILE__, __LINE__, fmt, ##__VA_ARGS__))
+
+#define LOG_ON(lvl) (log_level().load(std::memory_order_relaxed) <= LOG_LVL_##lvl)
+
+#define LOG_LVL(lvl, fmt, ...) (LOG_ON(lvl) ? LOG_AT(#lvl, fmt, ##__VA_ARGS__) : (void) 0)
+
+// every n-th call of this line, counted across threads.
+#define LOG_EVERY_N(lvl, n, fmt, ...) do { \
+        static std::atomic<uint64_t> log_cnt_{0}; \
+        if (LOG_ON(lvl) && log_cnt_.fetch_add(1, std::memory_order_relaxed) % (n) == 0) { \
+            LOG_AT(#lvl, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+// at most once per ms for this line, with the count of calls held back.
+#define LOG_RATE_LIMITED(lvl, ms, fmt, ...) do { \
+        static std::atomic<int64_t> log_next_{0}; \
+        static std::atomic<uint64_t> log_skip_{0}; \
+        if (LOG_ON(lvl) && log_rate_ok(&log_next_, &log_skip_, ms)) { \
+            auto log_held_ = log_skip_.exchange(0, std::memory_order_relaxed); \
+            if (log_held_ > 0) { \
+                LOG_AT(#lvl, "[%lu suppressed] " fmt, (unsigned long) log_held_, ##__VA_ARGS__); \
+            } else { \
+                LOG_AT(#lvl, fmt, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_OFF(...) ((void) 0)
+
+#if LOG_MIN_LEVEL <= LOG_LVL_TRC
+#define TRC(fmt, ...) LOG_LVL(TRC, fmt, ##__VA_ARGS__)
+#define TRC_EVERY_N(n, fmt, ...) LOG_EVERY_N(TRC, n, fmt, ##__VA_ARGS__)
+#define TRC_RATE_LIMITED(ms, fmt, ...) LOG_RATE_LIMITED(TRC, ms, fmt, ##__VA_ARGS__)
+#else
+#define TRC LOG_OFF
+#define TRC_EVERY_N LOG_OFF
+#define TRC_RATE_LIMITED LOG_OFF
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_INF
+#define INF(fmt, ...) LOG_LVL(INF, fmt, ##__VA_ARGS__)
+#define INF_EVERY_N(n, fmt, ...) LOG_EVERY_N(INF, n, fmt, ##__VA_ARGS__)
+#define INF_RATE_LIMITED(ms, fmt, ...) LOG_RATE_LIMITED(INF, ms, fmt, ##__VA_ARGS__)
+#else
+#define INF LOG_OFF
+#define INF_EVERY_N LOG_OFF
+#define INF_RATE_LIMITED LOG_OFF
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_WRN
+#define WRN(fmt, ...) LOG_LVL(WRN, fmt, ##__VA_ARGS__)
+#define WRN_EVERY_N(n, fmt, ...) LOG_EVERY_N(WRN, n, fmt, ##__VA_ARGS__)
+#define WRN_RATE_LIMITED(ms, fmt, ...) LOG_RATE_LIMITED(WRN, ms, fmt, ##__VA_ARGS__)
+#else
+#define WRN LOG_OFF
+#define WRN_EVERY_N LOG_OFF
+#define WRN_RATE_LIMITED LOG_OFF
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_SYS
+#define SYS(fmt, ...) LOG_LVL(SYS, fmt, ##__VA_ARGS__)
+#define SYS_EVERY_N(n, fmt, ...) LOG_EVERY_N(SYS, n, fmt, ##__VA_ARGS__)
+#define SYS_RATE_LIMITED(ms, fmt, ...) LOG_RATE_LIMITED(SYS, ms, fmt, ##__VA_ARGS__)
+#else
+#define SYS LOG_OFF
+#define SYS_EVERY_N LOG_OFF
+#define SYS_RATE_LIMITED LOG_OFF
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_ERR
+#define ERR(fmt, ...) LOG_LVL(ERR, fmt, ##__VA_ARGS__)
+#define ERR_EVERY_N(n, fmt, ...) LOG_EVERY_N(ERR, n, fmt, ##__VA_ARGS__)
+#define ERR_RATE_LIMITED(ms, fmt, ...) LOG_RATE_LIMITED(ERR, ms, fmt, ##__VA_ARGS__)
+#else
+#define ERR LOG_OFF
+#define ERR_EVERY_N LOG_OFF
+#define ERR_RATE_LIMITED LOG_OFF
+#endif
+
+// never filtered.
+#define DIE(fmt, ...) LOG_AT("DIE", fmt, ##__VA_ARGS__), log_exit(errno)
+
+#endif //UTILS_LOG_STD_H